@@ -1,20 +1,567 @@
+#include "server/broadcast_compressor.hpp"
+#include "server/latency_histogram.hpp"
+#include "server/protocol.hpp"
+#include "server/risk_checks.hpp"
 #include <atomic>
 #include <benchmark/benchmark.h>
 #include <chrono>
 #include <condition_variable>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <map>
 #include <mutex>
 #include <nlohmann/json.hpp>
 #include <random>
+#include <sstream>
+#include <sys/resource.h>
 #include <thread>
+#include <unistd.h>
 #include <websocketpp/client.hpp>
 #include <websocketpp/config/asio_no_tls.hpp>
+#include <websocketpp/config/core.hpp>
+#include <websocketpp/frame.hpp>
+#include <websocketpp/server.hpp>
 
 using json = nlohmann::json;
 typedef websocketpp::client<websocketpp::config::asio> client;
+// iostream transport: connections that live entirely in memory
+typedef websocketpp::server<websocketpp::config::core> memoryserver;
+
+// Recorded exchange traffic, relative to the repository root
+static const char *const recorded_orderbook_updates =
+    "benchmark_data/orderbook_updates.jsonl";
+static const char *const recorded_client_requests =
+    "benchmark_data/client_requests.jsonl";
+
+static std::vector<std::string> loadrecordedpayloads(const char *path) {
+  std::vector<std::string> payloads;
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty()) {
+      payloads.push_back(line);
+    }
+  }
+  return payloads;
+}
+
+static double threadcputimens() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef std::chrono::high_resolution_clock::time_point timepoint;
+
+// Reports one iteration's latency to Google Benchmark and to the histogram.
+static void recordsample(benchmark::State &state, latency_histogram &latencies,
+                         timepoint start) {
+  auto elapsed = std::chrono::high_resolution_clock::now() - start;
+  state.SetIterationTime(std::chrono::duration<double>(elapsed).count());
+  latencies.record(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+// A timed-out iteration still costs its wait in the mean, but is kept out of
+// the histogram so the percentiles describe completed round trips.
+static void recordtimeout(benchmark::State &state, int64_t &timeouts,
+                          timepoint start) {
+  auto elapsed = std::chrono::high_resolution_clock::now() - start;
+  state.SetIterationTime(std::chrono::duration<double>(elapsed).count());
+  ++timeouts;
+}
+
+// Google Benchmark only reports the mean iteration time, which hides the
+// tail. Publish percentiles as counters, and if BENCHMARK_HISTOGRAM_DIR is
+// set write the full distribution to <dir>/<name>.hgrm.
+static void reportlatency(benchmark::State &state,
+                          const latency_histogram &latencies, int64_t timeouts,
+                          const std::string &name) {
+  auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1e3; };
+  state.counters["samples"] = static_cast<double>(latencies.count());
+  state.counters["timeouts"] = static_cast<double>(timeouts);
+  state.counters["p50_us"] = us(latencies.percentile(50));
+  state.counters["p90_us"] = us(latencies.percentile(90));
+  state.counters["p99_us"] = us(latencies.percentile(99));
+  state.counters["p999_us"] = us(latencies.percentile(99.9));
+  state.counters["max_us"] = us(latencies.max());
+
+  const char *dir = std::getenv("BENCHMARK_HISTOGRAM_DIR");
+  if (dir && *dir) {
+    std::ofstream out(std::string(dir) + "/" + name + ".hgrm");
+    latencies.dump(out, 1e3);
+  }
+}
+
+// Percentiles for one stage of a latency that has been split into parts,
+// published as <prefix>_p50_us etc. alongside the overall counters.
+static void reportcomponent(benchmark::State &state,
+                            const latency_histogram &latencies,
+                            const std::string &prefix,
+                            const std::string &name) {
+  auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1e3; };
+  state.counters[prefix + "_p50_us"] = us(latencies.percentile(50));
+  state.counters[prefix + "_p99_us"] = us(latencies.percentile(99));
+  state.counters[prefix + "_max_us"] = us(latencies.max());
+
+  const char *dir = std::getenv("BENCHMARK_HISTOGRAM_DIR");
+  if (dir && *dir) {
+    std::ofstream out(std::string(dir) + "/" + name + "_" + prefix + ".hgrm");
+    latencies.dump(out, 1e3);
+  }
+}
+
+// Cumulative user+system cpu of another process, from /proc (Linux only).
+static double processcputimens(long pid) {
+  std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  std::getline(in, stat);
+  // comm may contain spaces; the fields we want follow the closing paren
+  size_t paren = stat.rfind(')');
+  if (paren == std::string::npos) {
+    return -1;
+  }
+  std::istringstream fields(stat.substr(paren + 2));
+  std::string skip;
+  for (int i = 0; i < 11; ++i) {
+    fields >> skip;
+  }
+  double utime = 0;
+  double stime = 0;
+  fields >> utime >> stime;
+  return (utime + stime) * 1e9 / sysconf(_SC_CLK_TCK);
+}
+
+static double processrsskb(long pid) {
+  std::ifstream in("/proc/" + std::to_string(pid) + "/status");
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) {
+      return std::atof(line.c_str() + 6);
+    }
+  }
+  return -1;
+}
+
+static int64_t monotonicns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
 
 class performancebenchmark {
 public:
-  static void measuremarketdatalatency(benchmark::state &state) {
+  // cpu spent deflating recorded orderbook updates once per broadcast, the
+  // way the server shares one compressed frame across all subscribers.
+  // args: deflate level, window bits
+  static void measurebroadcastcompression(benchmark::State &state) {
+    const auto payloads = loadrecordedpayloads(recorded_orderbook_updates);
+    if (payloads.empty()) {
+      state.SkipWithError("no recorded orderbook updates found");
+      return;
+    }
+
+    broadcast_compressor compressor(static_cast<int>(state.range(1)),
+                                    static_cast<int>(state.range(0)), 8);
+    std::string compressed;
+    size_t index = 0;
+    int64_t bytes_in = 0;
+    int64_t bytes_out = 0;
+
+    double cpu_start = threadcputimens();
+    for (auto _ : state) {
+      const std::string &payload = payloads[index++ % payloads.size()];
+      bytes_in += payload.size();
+      if (compressor.compress(payload, compressed)) {
+        bytes_out += compressed.size();
+      } else {
+        bytes_out += payload.size();
+      }
+    }
+    double cpu_ns = threadcputimens() - cpu_start;
+
+    state.SetBytesProcessed(bytes_in);
+    state.counters["ratio"] =
+        static_cast<double>(bytes_out) / static_cast<double>(bytes_in);
+    state.counters["bytes_saved_per_msg"] = benchmark::Counter(
+        static_cast<double>(bytes_in - bytes_out),
+        benchmark::Counter::kAvgIterations);
+    if (bytes_in > bytes_out) {
+      state.counters["cpu_ns_per_byte_saved"] =
+          cpu_ns / static_cast<double>(bytes_in - bytes_out);
+    }
+  }
+
+  // json parse of an inbound client message plus the switch on its type,
+  // i.e. everything process_message does before the handler runs.
+  static void measurerequestdispatch(benchmark::State &state) {
+    const auto payloads = loadrecordedpayloads(recorded_client_requests);
+    if (payloads.empty()) {
+      state.SkipWithError("no recorded client requests found");
+      return;
+    }
+
+    size_t index = 0;
+    int64_t bytes = 0;
+    for (auto _ : state) {
+      const std::string &payload = payloads[index++ % payloads.size()];
+      json j = json::parse(payload);
+      std::string type = j["type"];
+      benchmark::DoNotOptimize(parse_request_type(type));
+      bytes += payload.size();
+    }
+    state.SetBytesProcessed(bytes);
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Validate a client order and serialize the exchange request for it.
+  static void measureorderrequestbuild(benchmark::State &state) {
+    std::vector<std::string> texts;
+    std::vector<json> orders;
+    for (const auto &payload : loadrecordedpayloads(recorded_client_requests)) {
+      json j = json::parse(payload);
+      if (j["type"] == "place_order") {
+        texts.push_back(payload);
+        orders.push_back(j["data"]);
+      }
+    }
+    if (orders.empty()) {
+      state.SkipWithError("no recorded place_order requests found");
+      return;
+    }
+
+    // The server runs pre-trade checks against its instrument table; give
+    // every recorded order a perpetual's 0.5 tick and 10 USD contract
+    instrument_registry instruments("", "");
+    std::vector<instrument_id> ids;
+    json result = json::array();
+    for (const json &order : orders) {
+      result.push_back({{"instrument_name", order["instrument_name"]},
+                        {"kind", "future"},
+                        {"tick_size", 0.5},
+                        {"contract_size", 10},
+                        {"min_trade_amount", 10}});
+    }
+    instruments.update("BTC", "future", json{{"result", result}}.dump());
+    for (const json &order : orders) {
+      ids.push_back(instruments.find(order["instrument_name"]));
+    }
+    pre_trade_risk risk(instruments);
+
+    size_t index = 0;
+    for (auto _ : state) {
+      size_t i = index++ % orders.size();
+      const json &order = orders[i];
+      if (inexact_number(texts[i]).empty() && validate_order(order).empty() &&
+          risk.check(ids[i], order).empty()) {
+        std::string body =
+            build_order_request(order, "o1792000000000-1", 1).dump();
+        benchmark::DoNotOptimize(body.data());
+      }
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // The orderbook loop's per-update cpu: parse the exchange's REST response
+  // and re-serialize it through an orderbook_update template.
+  static void measureorderbookreserialize(benchmark::State &state) {
+    std::vector<std::string> responses;
+    for (const auto &payload :
+         loadrecordedpayloads(recorded_orderbook_updates)) {
+      json update = json::parse(payload);
+      responses.push_back(
+          json{{"jsonrpc", "2.0"}, {"result", update["data"]}}.dump());
+    }
+    if (responses.empty()) {
+      state.SkipWithError("no recorded orderbook updates found");
+      return;
+    }
+
+    json update_template = orderbook_update_template();
+    size_t index = 0;
+    int64_t bytes_in = 0;
+    for (auto _ : state) {
+      const std::string &body = responses[index++ % responses.size()];
+      json orderbook = json::parse(body);
+      update_template["instrument"] = "BTC-PERPETUAL";
+      update_template["timestamp"] = index;
+      update_template["data"] = std::move(orderbook["result"]);
+      std::string out = update_template.dump();
+      benchmark::DoNotOptimize(out.data());
+      bytes_in += body.size();
+    }
+    state.SetBytesProcessed(bytes_in);
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Frame one recorded update and queue it on K open connections that write
+  // to an in-memory sink, as broadcast() does, without any socket I/O.
+  // args: connections
+  static void measurebroadcastfanout(benchmark::State &state) {
+    const auto payloads = loadrecordedpayloads(recorded_orderbook_updates);
+    if (payloads.empty()) {
+      state.SkipWithError("no recorded orderbook updates found");
+      return;
+    }
+
+    memoryserver endpoint;
+    endpoint.clear_access_channels(websocketpp::log::alevel::all);
+    endpoint.clear_error_channels(websocketpp::log::elevel::all);
+
+    const std::string handshake =
+        "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+        "Connection: Upgrade\r\nSec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+    int64_t written = 0;
+    std::vector<memoryserver::connection_ptr> connections;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      memoryserver::connection_ptr con = endpoint.get_connection();
+      con->set_write_handler(
+          [&written](websocketpp::connection_hdl, const char *, size_t len) {
+            written += len;
+            return websocketpp::lib::error_code();
+          });
+      con->start();
+      con->read_all(handshake.data(), handshake.size());
+      if (con->get_state() != websocketpp::session::state::open) {
+        state.SkipWithError("in-memory handshake failed");
+        return;
+      }
+      connections.push_back(con);
+    }
+
+    size_t index = 0;
+    int64_t bytes = 0;
+    for (auto _ : state) {
+      const std::string &payload = payloads[index++ % payloads.size()];
+      auto frame = make_prepared_frame<websocketpp::config::core::message_type>(
+          payload, websocketpp::frame::opcode::text, false);
+      for (const auto &con : connections) {
+        con->send(frame);
+      }
+      bytes += payload.size();
+    }
+    state.SetBytesProcessed(bytes * state.range(0));
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.counters["bytes_written_per_msg"] = benchmark::Counter(
+        static_cast<double>(written), benchmark::Counter::kAvgIterations);
+  }
+
+  // Mask/unmask throughput of the routines the hybi13 processor uses on
+  // client frames, over bytes taken from recorded updates.
+  // args: routine (0 byte_mask_circ, 1 word_mask_circ, 2 word_mask_exact),
+  //       buffer size
+  static void measureframemasking(benchmark::State &state) {
+    const auto payloads = loadrecordedpayloads(recorded_orderbook_updates);
+    std::string source;
+    for (size_t i = 0; !payloads.empty() &&
+                       source.size() < static_cast<size_t>(state.range(1));
+         ++i) {
+      source += payloads[i % payloads.size()];
+    }
+    if (source.empty()) {
+      state.SkipWithError("no recorded orderbook updates found");
+      return;
+    }
+    std::vector<uint8_t> buffer(source.begin(),
+                                source.begin() + state.range(1));
+
+    websocketpp::frame::masking_key_type key;
+    key.i = 0x5a3c96e1;
+    size_t prepared = websocketpp::frame::prepare_masking_key(key);
+
+    for (auto _ : state) {
+      switch (state.range(0)) {
+      case 0:
+        prepared = websocketpp::frame::byte_mask_circ(buffer.data(),
+                                                      buffer.size(), prepared);
+        break;
+      case 1:
+        prepared = websocketpp::frame::word_mask_circ(buffer.data(),
+                                                      buffer.size(), prepared);
+        break;
+      default:
+        websocketpp::frame::word_mask_exact(buffer.data(), buffer.size(), key);
+        break;
+      }
+      benchmark::DoNotOptimize(buffer.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(1));
+  }
+
+  // Opens N clients against the running server and follows each
+  // orderbook_update until every client has it. Per update this reports the
+  // fan-out spread (first to last client) and the last client's delivery
+  // latency from the server's send stamp. With BENCHMARK_SERVER_PID set it
+  // also samples the server's cpu and its RSS growth per connection.
+  // args: clients
+  static void measurebroadcastscaling(benchmark::State &state) {
+    const int clients = static_cast<int>(state.range(0));
+    const char *pid_env = std::getenv("BENCHMARK_SERVER_PID");
+    const long server_pid = pid_env ? std::atol(pid_env) : 0;
+
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < static_cast<rlim_t>(clients) + 64) {
+      limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, clients + 64);
+      setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    double rss_before = server_pid ? processrsskb(server_pid) : -1;
+
+    client ws_client;
+    ws_client.clear_access_channels(websocketpp::log::alevel::all);
+    ws_client.clear_error_channels(websocketpp::log::elevel::all);
+    ws_client.init_asio();
+    ws_client.start_perpetual();
+
+    struct delivery {
+      int64_t first = 0;
+      int64_t last = 0;
+      int received = 0;
+    };
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::atomic<int> open{0};
+    std::atomic<int> failed{0};
+    std::map<int64_t, delivery> pending; // keyed by the server's send stamp
+    std::deque<std::pair<int64_t, delivery>> complete;
+
+    // Only the send stamp is needed, so skip a full parse: with thousands
+    // of clients the benchmark's own json cost would swamp the server's.
+    static const char stamp_key[] = "\"send_mono_ns\":";
+    auto on_message = [&](websocketpp::connection_hdl,
+                          client::message_ptr msg) {
+      int64_t received = monotonicns();
+      const std::string &payload = msg->get_payload();
+      size_t pos = payload.find(stamp_key);
+      if (pos == std::string::npos) {
+        return;
+      }
+      int64_t sent = std::strtoll(
+          payload.c_str() + pos + sizeof(stamp_key) - 1, nullptr, 10);
+
+      std::lock_guard<std::mutex> lock(mtx);
+      delivery &d = pending[sent];
+      if (d.received++ == 0) {
+        d.first = received;
+      }
+      d.last = received;
+      if (d.received == clients) {
+        complete.emplace_back(sent, d);
+        pending.erase(sent);
+        cv.notify_one();
+      }
+      // Updates some client never got (e.g. a dropped connection)
+      while (pending.size() > 1024) {
+        pending.erase(pending.begin());
+      }
+    };
+
+    unsigned io_threads =
+        std::max(1u, std::min(4u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < io_threads; ++i) {
+      threads.emplace_back([&ws_client] { ws_client.run(); });
+    }
+    auto shutdown = [&] {
+      ws_client.stop_perpetual();
+      ws_client.stop();
+      for (auto &t : threads) {
+        t.join();
+      }
+    };
+
+    // Connect in batches: thousands of simultaneous handshakes against a
+    // server that is also broadcasting run past the open handshake timeout.
+    const int batch = 100;
+    for (int issued = 0; issued < clients && failed == 0;) {
+      for (int end = std::min(clients, issued + batch); issued < end;
+           ++issued) {
+        websocketpp::lib::error_code ec;
+        client::connection_ptr con =
+            ws_client.get_connection("ws://localhost:9002", ec);
+        if (ec) {
+          ++failed;
+          continue;
+        }
+        con->set_open_handler([&](websocketpp::connection_hdl) { ++open; });
+        con->set_fail_handler([&](websocketpp::connection_hdl) { ++failed; });
+        con->set_message_handler(on_message);
+        ws_client.connect(con);
+      }
+      auto deadline =
+          std::chrono::steady_clock::now() + std::chrono::seconds(10);
+      while (open + failed < issued &&
+             std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+    }
+    if (open < clients) {
+      shutdown();
+      state.SkipWithError((std::to_string(open.load()) + " of " +
+                           std::to_string(clients) + " clients connected, " +
+                           std::to_string(failed.load()) + " failed")
+                              .c_str());
+      return;
+    }
+
+    // Skip updates that were in flight while clients were still joining
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      pending.clear();
+      complete.clear();
+    }
+
+    latency_histogram fanout;
+    latency_histogram last_client;
+    int64_t timeouts = 0;
+    double cpu_start = server_pid ? processcputimens(server_pid) : -1;
+    auto wall_start = std::chrono::steady_clock::now();
+
+    for (auto _ : state) {
+      auto start = std::chrono::high_resolution_clock::now();
+      std::pair<int64_t, delivery> update;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!cv.wait_for(lock, std::chrono::seconds(5),
+                         [&] { return !complete.empty(); })) {
+          recordtimeout(state, timeouts, start);
+          continue;
+        }
+        update = complete.front();
+        complete.pop_front();
+      }
+      int64_t latency = update.second.last - update.first;
+      state.SetIterationTime(latency / 1e9);
+      fanout.record(update.second.last - update.second.first);
+      last_client.record(latency > 0 ? latency : 0);
+    }
+
+    double wall_ns = std::chrono::duration<double, std::nano>(
+                         std::chrono::steady_clock::now() - wall_start)
+                         .count();
+    double cpu_end = server_pid ? processcputimens(server_pid) : -1;
+    double rss_after = server_pid ? processrsskb(server_pid) : -1;
+    shutdown();
+
+    const std::string name =
+        "measurebroadcastscaling_" + std::to_string(clients);
+    reportlatency(state, last_client, timeouts, name);
+    reportcomponent(state, fanout, "fanout", name);
+    state.counters["clients"] = clients;
+    if (cpu_start >= 0 && cpu_end >= 0) {
+      state.counters["server_cpu_pct"] = 100.0 * (cpu_end - cpu_start) / wall_ns;
+    }
+    if (rss_before >= 0 && rss_after >= 0) {
+      state.counters["server_rss_kb_per_client"] =
+          (rss_after - rss_before) / clients;
+    }
+  }
+
+  static void measuremarketdatalatency(benchmark::State &state) {
     client ws_client;
     ws_client.clear_access_channels(websocketpp::log::alevel::all);
     ws_client.set_access_channels(websocketpp::log::alevel::connect);
@@ -30,11 +577,18 @@ public:
     websocketpp::connection_hdl connection_hdl;
     client::connection_ptr con;
 
+    // Stages of the last update's latency in ns, guarded by mtx
+    struct stages {
+      int64_t exchange_to_server;
+      int64_t in_server;
+      int64_t server_to_client;
+    } last = {};
+
     // create connection
     websocketpp::lib::error_code ec;
     con = ws_client.get_connection("ws://localhost:9002", ec);
     if (ec) {
-      state.skipwitherror(std::string("connection creation failed: ")
+      state.SkipWithError(std::string("connection creation failed: ")
                               .append(ec.message())
                               .c_str());
       return;
@@ -51,9 +605,27 @@ public:
     con->set_message_handler(
         [&](websocketpp::connection_hdl, client::message_ptr msg) {
           try {
+            int64_t received = monotonicns();
             auto payload = msg->get_payload();
             json response = json::parse(payload);
-            if (response["type"] == "orderbook_update") {
+            if (response["type"] == "orderbook_update" &&
+                response["latency"].is_object()) {
+              const json &ts = response["latency"];
+              stages sample;
+              // The exchange stamps in milliseconds on its own clock, so
+              // this stage is only as good as clock sync and may come out
+              // slightly negative.
+              sample.exchange_to_server =
+                  ts["recv_wall_ns"].get<int64_t>() -
+                  ts["exchange_ms"].get<int64_t>() * 1000000;
+              sample.in_server = ts["send_mono_ns"].get<int64_t>() -
+                                 ts["recv_mono_ns"].get<int64_t>();
+              // The server runs on this host, so monotonic clocks agree
+              sample.server_to_client =
+                  received - ts["send_mono_ns"].get<int64_t>();
+
+              std::lock_guard<std::mutex> lock(mtx);
+              last = sample;
               messagereceived = true;
               cv.notify_one();
             }
@@ -100,25 +672,45 @@ public:
     // wait longer for subscription to be processed
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
 
-    // benchmark loop
+    latency_histogram latencies;
+    latency_histogram exchange_to_server;
+    latency_histogram in_server;
+    latency_histogram server_to_client;
+    int64_t timeouts = 0;
+    auto clamp = [](int64_t ns) {
+      return static_cast<uint64_t>(ns < 0 ? 0 : ns);
+    };
+
+    // Each iteration is one update; its time is the update's total latency
+    // from the exchange stamp to arrival here, not the gap between updates.
     for (auto _ : state) {
-      messagereceived = false;
       auto start = std::chrono::high_resolution_clock::now();
-
+      stages sample;
       {
         std::unique_lock<std::mutex> lock(mtx);
+        messagereceived = false;
         if (!cv.wait_for(lock, std::chrono::seconds(5),
                          [&] { return messagereceived.load(); })) {
+          recordtimeout(state, timeouts, start);
           continue; // skip this iteration but continue the benchmark
         }
+        sample = last;
       }
 
-      auto end = std::chrono::high_resolution_clock::now();
-      auto elapsed_seconds =
-          std::chrono::duration_cast<std::chrono::duration<double>>(end - start)
-              .count();
-      state.setiterationtime(elapsed_seconds);
+      uint64_t total = clamp(sample.exchange_to_server) +
+                       clamp(sample.in_server) +
+                       clamp(sample.server_to_client);
+      state.SetIterationTime(total / 1e9);
+      latencies.record(total);
+      exchange_to_server.record(clamp(sample.exchange_to_server));
+      in_server.record(clamp(sample.in_server));
+      server_to_client.record(clamp(sample.server_to_client));
     }
+    const std::string name = "measuremarketdatalatency";
+    reportlatency(state, latencies, timeouts, name);
+    reportcomponent(state, exchange_to_server, "exchange_server", name);
+    reportcomponent(state, in_server, "server", name);
+    reportcomponent(state, server_to_client, "server_client", name);
 
     // cleanup
     try {
@@ -135,7 +727,12 @@ public:
     }
   }
 
-  static void measureorderplacementlatency(benchmark::state &state) {
+  // Each iteration sends range(0) orders, a basket, and times until every
+  // response is in. With range(1) set the basket goes as one place_orders
+  // message, otherwise as place_order messages back to back.
+  static void measureorderplacementlatency(benchmark::State &state) {
+    const int basket = static_cast<int>(state.range(0));
+    const bool batched = state.range(1) != 0;
     client ws_client;
     ws_client.clear_access_channels(websocketpp::log::alevel::all);
     ws_client.set_access_channels(websocketpp::log::alevel::connect);
@@ -145,7 +742,7 @@ public:
     ws_client.init_asio();
 
     std::atomic<bool> connected{false};
-    std::atomic<bool> orderresponsereceived{false};
+    std::atomic<int> orderresponses{0};
     std::mutex mtx;
     std::condition_variable cv;
     websocketpp::connection_hdl connection_hdl;
@@ -174,7 +771,10 @@ public:
           json response = json::parse(payload);
 
           if (response["type"] == "order_response") {
-            orderresponsereceived = true;
+            ++orderresponses;
+            cv.notify_one();
+          } else if (response["type"] == "place_orders_response") {
+            orderresponses += static_cast<int>(response["results"].size());
             cv.notify_one();
           }
         } catch (const json::exception &e) {
@@ -188,7 +788,7 @@ public:
     };
 
     if (!connect()) {
-      state.skipwitherror("order placement initial connection failed");
+      state.SkipWithError("order placement initial connection failed");
       return;
     }
 
@@ -205,7 +805,7 @@ public:
       std::unique_lock<std::mutex> lock(mtx);
       if (!cv.wait_for(lock, std::chrono::seconds(10),
                        [&] { return connected.load(); })) {
-        state.skipwitherror("order placement initial connection timeout");
+        state.SkipWithError("order placement initial connection timeout");
         ws_client.stop();
         if (ws_thread.joinable())
           ws_thread.join();
@@ -216,33 +816,50 @@ public:
     std::random_device rd;
     std::mt19937 gen(rd());
     std::uniform_int_distribution<> contracts_dist(1, 10); // 1-10 contracts
-    std::uniform_real_distribution<> price_dist(20000.0, 70000.0);
+    // 20000-70000 in whole ticks of BTC-PERPETUAL's 0.5
+    const decimal tick_size = decimal::from_units(decimal::scale / 2);
+    std::uniform_int_distribution<int64_t> price_ticks_dist(40000, 140000);
     std::bernoulli_distribution bool_dist(0.5);
 
+    latency_histogram latencies;
+    int64_t timeouts = 0;
     for (auto _ : state) {
-      orderresponsereceived = false;
-
-      int contracts = contracts_dist(gen);
-      double price =
-          std::round(price_dist(gen) * 0.5) / 0.5; // 0.5 tick size for price
-
-      json order = {
-          {"type", "place_order"},
-          {"data",
-           {{"instrument_name", "btc-perpetual"},
-            {"amount", contracts * 10}, // convert contracts to usd amount
-            {"type", "limit"}, // always use limit orders for consistency
-            {"direction", bool_dist(gen) ? "buy" : "sell"},
-            {"price", price}}}};
+      orderresponses = 0;
+
+      std::vector<std::string> orders;
+      json batch = {{"type", "place_orders"}, {"data", json::array()}};
+      for (int i = 0; i < basket; ++i) {
+        int contracts = contracts_dist(gen);
+        decimal price =
+            decimal::from_units(price_ticks_dist(gen) * tick_size.units());
+
+        json order = {
+            {"type", "place_order"},
+            {"data",
+             {{"instrument_name", "BTC-PERPETUAL"},
+              {"amount", contracts * 10}, // convert contracts to usd amount
+              {"type", "limit"}, // always use limit orders for consistency
+              {"direction", bool_dist(gen) ? "buy" : "sell"},
+              {"price", price.to_double()}}}};
+        if (batched) {
+          batch["data"].push_back(order["data"]);
+        } else {
+          orders.push_back(order.dump());
+        }
+      }
+      if (batched) {
+        orders.push_back(batch.dump());
+      }
 
       auto start = std::chrono::high_resolution_clock::now();
 
       try {
-        std::string order_str = order.dump();
-        ws_client.send(connection_hdl, order_str,
-                       websocketpp::frame::opcode::text);
+        for (const auto &order_str : orders) {
+          ws_client.send(connection_hdl, order_str,
+                         websocketpp::frame::opcode::text);
+        }
       } catch (const std::exception &e) {
-        state.skipwitherror(
+        state.SkipWithError(
             std::string("order send failed: ").append(e.what()).c_str());
         continue;
       }
@@ -250,17 +867,15 @@ public:
       {
         std::unique_lock<std::mutex> lock(mtx);
         if (!cv.wait_for(lock, std::chrono::seconds(10),
-                         [&] { return orderresponsereceived.load(); })) {
+                         [&] { return orderresponses.load() >= basket; })) {
+          recordtimeout(state, timeouts, start);
           continue;
         }
       }
 
-      auto end = std::chrono::high_resolution_clock::now();
-      auto elapsed_seconds =
-          std::chrono::duration_cast<std::chrono::duration<double>>(end - start)
-              .count();
-      state.setiterationtime(elapsed_seconds);
+      recordsample(state, latencies, start);
     }
+    reportlatency(state, latencies, timeouts, "measureorderplacementlatency");
 
     try {
       if (connected) {
@@ -276,7 +891,7 @@ public:
     }
   }
 
-  static void measurewebsocketpropagationdelay(benchmark::state &state) {
+  static void measurewebsocketpropagationdelay(benchmark::State &state) {
     client ws_client;
     ws_client.clear_access_channels(websocketpp::log::alevel::all);
     ws_client.set_access_channels(websocketpp::log::alevel::connect);
@@ -296,7 +911,7 @@ public:
     websocketpp::lib::error_code ec;
     con = ws_client.get_connection("ws://localhost:9002", ec);
     if (ec) {
-      state.skipwitherror(std::string("connection creation failed: ")
+      state.SkipWithError(std::string("connection creation failed: ")
                               .append(ec.message())
                               .c_str());
       return;
@@ -341,7 +956,7 @@ public:
       std::unique_lock<std::mutex> lock(mtx);
       if (!cv.wait_for(lock, std::chrono::seconds(10),
                        [&] { return connected.load(); })) {
-        state.skipwitherror("initial connection timeout");
+        state.SkipWithError("initial connection timeout");
         ws_client.stop();
         if (ws_thread.joinable())
           ws_thread.join();
@@ -349,6 +964,9 @@ public:
       }
     }
 
+    latency_histogram latencies;
+    int64_t timeouts = 0;
+
     // benchmark loop
     for (auto _ : state) {
       messagereceived = false;
@@ -360,7 +978,7 @@ public:
         ws_client.send(connection_hdl, echo_message.dump(),
                        websocketpp::frame::opcode::text);
       } catch (const std::exception &e) {
-        state.skipwitherror(
+        state.SkipWithError(
             std::string("message send failed: ").append(e.what()).c_str());
         continue;
       }
@@ -370,16 +988,14 @@ public:
         if (!cv.wait_for(lock, std::chrono::seconds(5),
                          [&] { return messagereceived.load(); })) {
           std::cout << "timeout waiting for echo response" << std::endl;
+          recordtimeout(state, timeouts, start);
           continue; // skip this iteration but continue the benchmark
         }
       }
 
-      auto end = std::chrono::high_resolution_clock::now();
-      auto elapsed_seconds =
-          std::chrono::duration_cast<std::chrono::duration<double>>(end - start)
-              .count();
-      state.setiterationtime(elapsed_seconds);
+      recordsample(state, latencies, start);
     }
+    reportlatency(state, latencies, timeouts, "measurewebsocketpropagationdelay");
 
     // cleanup
     try {
@@ -396,7 +1012,7 @@ public:
     }
   }
 
-  static void measureendtoendtradinglatency(benchmark::state &state) {
+  static void measureendtoendtradinglatency(benchmark::State &state) {
     client ws_client;
     ws_client.clear_access_channels(websocketpp::log::alevel::all);
     ws_client.set_access_channels(websocketpp::log::alevel::connect);
@@ -438,6 +1054,12 @@ public:
 
           if (response["type"] == "order_response") {
             orderresponsereceived = true;
+            // market orders come back already filled
+            if (response.contains("result") &&
+                response["result"]["order"].value("order_state", "") ==
+                    "filled") {
+              orderexecuted = true;
+            }
             cv.notify_one();
           } else if (response["type"] == "order_execution") {
             std::cout << "order executed" << std::endl;
@@ -455,7 +1077,7 @@ public:
     };
 
     if (!connect()) {
-      state.skipwitherror("end-to-end trading initial connection failed");
+      state.SkipWithError("end-to-end trading initial connection failed");
       return;
     }
 
@@ -472,7 +1094,7 @@ public:
       std::unique_lock<std::mutex> lock(mtx);
       if (!cv.wait_for(lock, std::chrono::seconds(10),
                        [&] { return connected.load(); })) {
-        state.skipwitherror("end-to-end trading initial connection timeout");
+        state.SkipWithError("end-to-end trading initial connection timeout");
         ws_client.stop();
         if (ws_thread.joinable())
           ws_thread.join();
@@ -485,6 +1107,8 @@ public:
     std::uniform_int_distribution<> contracts_dist(1, 10); // 1-10 contracts
     std::bernoulli_distribution bool_dist(0.5);
 
+    latency_histogram latencies;
+    int64_t timeouts = 0;
     for (auto _ : state) {
       orderresponsereceived = false;
       orderexecuted = false;
@@ -494,7 +1118,7 @@ public:
       json order = {
           {"type", "place_order"},
           {"data",
-           {{"instrument_name", "btc-perpetual"},
+           {{"instrument_name", "BTC-PERPETUAL"},
             {"amount", contracts * 10}, // convert contracts to usd amount
             {"type", "market"},
             {"direction", bool_dist(gen) ? "buy" : "sell"}}}};
@@ -506,7 +1130,7 @@ public:
         ws_client.send(connection_hdl, order_str,
                        websocketpp::frame::opcode::text);
       } catch (const std::exception &e) {
-        state.skipwitherror(
+        state.SkipWithError(
             std::string("order send failed: ").append(e.what()).c_str());
         continue;
       }
@@ -516,6 +1140,7 @@ public:
         if (!cv.wait_for(lock, std::chrono::seconds(10),
                          [&] { return orderresponsereceived.load(); })) {
           std::cout << "timeout waiting for order response" << std::endl;
+          recordtimeout(state, timeouts, start);
           continue;
         }
       }
@@ -525,16 +1150,14 @@ public:
         if (!cv.wait_for(lock, std::chrono::seconds(5),
                          [&] { return orderexecuted.load(); })) {
           std::cout << "timeout waiting for order execution" << std::endl;
+          recordtimeout(state, timeouts, start);
           continue;
         }
       }
 
-      auto end = std::chrono::high_resolution_clock::now();
-      auto elapsed_seconds =
-          std::chrono::duration_cast<std::chrono::duration<double>>(end - start)
-              .count();
-      state.setiterationtime(elapsed_seconds);
+      recordsample(state, latencies, start);
     }
+    reportlatency(state, latencies, timeouts, "measureendtoendtradinglatency");
 
     try {
       if (connected) {
@@ -552,20 +1175,68 @@ public:
   }
 };
 
-benchmark(performancebenchmark::measuremarketdatalatency)
-    ->iterations(1)
-    ->unit(benchmark::kmillisecond);
-
-benchmark(performancebenchmark::measureorderplacementlatency)
-    ->iterations(1)
-    ->unit(benchmark::kmillisecond);
-
-benchmark(performancebenchmark::measurewebsocketpropagationdelay)
-    ->iterations(100)
-    ->unit(benchmark::kmicrosecond);
-
-benchmark(performancebenchmark::measureendtoendtradinglatency)
-    ->iterations(1)
-    ->unit(benchmark::kmillisecond);
-
-benchmark_main();
+BENCHMARK(performancebenchmark::measurebroadcastcompression)
+    ->ArgNames({"level", "window_bits"})
+    ->ArgsProduct({{1, 6, 9}, {9, 12, 15}})
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(performancebenchmark::measurerequestdispatch)
+    ->Unit(benchmark::kNanosecond);
+
+BENCHMARK(performancebenchmark::measureorderrequestbuild)
+    ->Unit(benchmark::kNanosecond);
+
+BENCHMARK(performancebenchmark::measureorderbookreserialize)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(performancebenchmark::measurebroadcastfanout)
+    ->ArgNames({"connections"})
+    ->Arg(1)
+    ->Arg(10)
+    ->Arg(100)
+    ->Arg(1000)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(performancebenchmark::measureframemasking)
+    ->ArgNames({"routine", "bytes"})
+    ->ArgsProduct({{0, 1, 2}, {64, 1024, 16384}});
+
+// Each iteration is one orderbook_update delivered to every client
+BENCHMARK(performancebenchmark::measurebroadcastscaling)
+    ->ArgNames({"clients"})
+    ->Arg(10)
+    ->Arg(100)
+    ->Arg(1000)
+    ->Arg(5000)
+    ->Iterations(200)
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Enough iterations for p99 to rest on more than a couple of samples
+BENCHMARK(performancebenchmark::measuremarketdatalatency)
+    ->Iterations(200)
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+// A basket of one is a single order's round trip; five shows whether the
+// server keeps several orders in flight or sends them one after another
+BENCHMARK(performancebenchmark::measureorderplacementlatency)
+    ->ArgNames({"basket", "batched"})
+    ->Args({1, 0})
+    ->Args({5, 0})
+    ->Args({5, 1})
+    ->Iterations(500)
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK(performancebenchmark::measurewebsocketpropagationdelay)
+    ->Iterations(10000)
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(performancebenchmark::measureendtoendtradinglatency)
+    ->Iterations(200)
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
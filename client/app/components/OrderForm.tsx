@@ -77,19 +77,26 @@ export default function OrderForm({
 
   const handleMessage = useCallback((event: MessageEvent) => {
     const data = JSON.parse(event.data);
-    if (data.type === "order_response") {
+    if (data.type === "order_ack") {
+      setMessage({
+        type: "success",
+        text: `Order accepted, sending to exchange. Client order ID: ${data.client_order_id}`,
+      });
+    } else if (data.type === "order_response") {
       setIsSubmitting(false);
       if (data.error) {
         setMessage({
           type: "error",
-          text: `Failed to place order: ${data.error}`,
+          text: `Failed to place order${
+            data.client_order_id ? ` ${data.client_order_id}` : ""
+          }: ${data.error}`,
         });
       } else {
         setMessage({
           type: "success",
           text: `Order placed successfully. Order ID: ${
             data.result?.order?.order_id || "N/A"
-          }`,
+          }, client order ID: ${data.client_order_id}`,
         });
         setAmount("");
         setPrice("");
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <websocketpp/common/time.hpp>
+#include <websocketpp/logger/levels.hpp>
+
+// websocketpp logger policy that never blocks the thread that logs.
+//
+// write() copies the message into a fixed-size slot of a bounded lock-free
+// ring (Vyukov's MPMC queue) and returns. A background thread formats the
+// entries and writes them out. When the ring is full the message is dropped
+// and counted instead of waiting for the drain thread. Messages longer than
+// `message_size` are truncated.
+template <typename names, size_t capacity = 1024, size_t message_size = 240>
+class async_logger {
+  static_assert((capacity & (capacity - 1)) == 0,
+                "capacity must be a power of two");
+
+public:
+  typedef websocketpp::log::level level;
+  typedef websocketpp::log::channel_type_hint channel_type_hint;
+
+  explicit async_logger(
+      channel_type_hint::value hint = channel_type_hint::access)
+      : async_logger(0xffffffff, hint) {}
+
+  async_logger(level static_channels, channel_type_hint::value hint)
+      : async_logger(static_channels, hint == channel_type_hint::error
+                                          ? &std::cerr
+                                          : &std::cout) {}
+
+  // Logs to `out`, which must outlive the logger. Channels start disabled.
+  async_logger(level static_channels, std::ostream *out)
+      : m_static_channels(static_channels), m_dynamic_channels(0),
+        m_out(out), m_slots(new slot[capacity]), m_enqueue_pos(0),
+        m_dequeue_pos(0), m_dropped(0), m_running(true) {
+    for (size_t i = 0; i < capacity; ++i) {
+      m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    m_drain_thread = std::thread(&async_logger::drain_loop, this);
+  }
+
+  ~async_logger() {
+    m_running.store(false, std::memory_order_release);
+    m_drain_thread.join();
+    drain();
+  }
+
+  async_logger(const async_logger &) = delete;
+  async_logger &operator=(const async_logger &) = delete;
+
+  void set_channels(level channels) {
+    if (channels == names::none) {
+      clear_channels(names::all);
+      return;
+    }
+    m_dynamic_channels.fetch_or(channels & m_static_channels,
+                                std::memory_order_relaxed);
+  }
+
+  void clear_channels(level channels) {
+    m_dynamic_channels.fetch_and(~channels, std::memory_order_relaxed);
+  }
+
+  void write(level channel, const std::string &msg) {
+    write(channel, msg.data(), msg.size());
+  }
+
+  void write(level channel, char const *msg) {
+    write(channel, msg, std::strlen(msg));
+  }
+
+  bool static_test(level channel) const {
+    return (channel & m_static_channels) != 0;
+  }
+
+  bool dynamic_test(level channel) {
+    return (channel & m_dynamic_channels.load(std::memory_order_relaxed)) !=
+           0;
+  }
+
+  // Messages lost because the ring was full
+  uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+  struct slot {
+    std::atomic<size_t> sequence;
+    level channel;
+    std::time_t time;
+    size_t length;
+    char text[message_size];
+  };
+
+  void write(level channel, char const *msg, size_t length) {
+    if (!dynamic_test(channel)) {
+      return;
+    }
+
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    slot *s;
+    for (;;) {
+      s = &m_slots[pos & (capacity - 1)];
+      size_t seq = s->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      } else {
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+
+    s->channel = channel;
+    s->time = std::time(nullptr);
+    s->length = length < message_size ? length : message_size;
+    std::memcpy(s->text, msg, s->length);
+    s->sequence.store(pos + 1, std::memory_order_release);
+  }
+
+  // Only ever called from one thread at a time: the drain thread, or the
+  // destructor after it has been joined.
+  size_t drain() {
+    size_t count = 0;
+    for (;;) {
+      slot &s = m_slots[m_dequeue_pos & (capacity - 1)];
+      if (s.sequence.load(std::memory_order_acquire) != m_dequeue_pos + 1) {
+        break;
+      }
+
+      std::tm lt = websocketpp::lib::localtime(s.time);
+      char stamp[20];
+      if (std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &lt) == 0) {
+        std::strcpy(stamp, "Unknown");
+      }
+      *m_out << "[" << stamp << "] [" << names::channel_name(s.channel) << "] ";
+      m_out->write(s.text, s.length);
+      *m_out << "\n";
+
+      s.sequence.store(m_dequeue_pos + capacity, std::memory_order_release);
+      ++m_dequeue_pos;
+      ++count;
+    }
+    if (count) {
+      m_out->flush();
+    }
+    return count;
+  }
+
+  void drain_loop() {
+    while (m_running.load(std::memory_order_acquire)) {
+      if (drain() == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+    }
+  }
+
+  const level m_static_channels;
+  std::atomic<level> m_dynamic_channels;
+  std::ostream *m_out;
+  std::unique_ptr<slot[]> m_slots;
+  std::atomic<size_t> m_enqueue_pos;
+  size_t m_dequeue_pos;
+  std::atomic<uint64_t> m_dropped;
+  std::atomic<bool> m_running;
+  std::thread m_drain_thread;
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <websocketpp/frame.hpp>
+#include <zlib.h>
+
+// Deflates outgoing payloads as self-contained permessage-deflate messages.
+//
+// Each message is compressed from a fresh LZ77 window (no context takeover),
+// so the output does not depend on anything a particular client received
+// earlier. The same compressed frame can therefore be written to every
+// connection that negotiated permessage-deflate.
+class broadcast_compressor {
+public:
+  broadcast_compressor(int window_bits, int level, int mem_level)
+      : m_window_bits(window_bits) {
+    m_stream.zalloc = Z_NULL;
+    m_stream.zfree = Z_NULL;
+    m_stream.opaque = Z_NULL;
+    m_ok = deflateInit2(&m_stream, level, Z_DEFLATED, -window_bits, mem_level,
+                        Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+
+  ~broadcast_compressor() {
+    if (m_ok) {
+      deflateEnd(&m_stream);
+    }
+  }
+
+  broadcast_compressor(const broadcast_compressor &) = delete;
+  broadcast_compressor &operator=(const broadcast_compressor &) = delete;
+
+  int window_bits() const { return m_window_bits; }
+
+  // Compress `in` into `out` as the payload of one permessage-deflate message,
+  // with the trailing 0x00 0x00 0xff 0xff of the sync flush removed. Returns
+  // false if zlib failed or the result is not smaller than the input.
+  bool compress(const std::string &in, std::string &out) {
+    if (!m_ok || in.empty()) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (deflateReset(&m_stream) != Z_OK) {
+      return false;
+    }
+
+    // deflateBound does not account for the sync flush marker.
+    out.resize(deflateBound(&m_stream, in.size()) + 16);
+
+    m_stream.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    m_stream.avail_in = static_cast<uInt>(in.size());
+    m_stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    m_stream.avail_out = static_cast<uInt>(out.size());
+
+    int ret = deflate(&m_stream, Z_SYNC_FLUSH);
+    if (ret != Z_OK || m_stream.avail_in != 0 || m_stream.avail_out == 0) {
+      return false;
+    }
+
+    size_t size = out.size() - m_stream.avail_out;
+    if (size < 4 || size - 4 >= in.size()) {
+      return false;
+    }
+    out.resize(size - 4);
+    return true;
+  }
+
+private:
+  z_stream m_stream;
+  std::mutex m_mutex;
+  int m_window_bits;
+  bool m_ok;
+};
+
+// Build a complete, unmasked server frame that can be handed to
+// connection::send on any number of connections.
+template <typename message_type>
+typename message_type::ptr
+make_prepared_frame(std::string payload, websocketpp::frame::opcode::value op,
+                    bool compressed) {
+  auto msg = std::make_shared<message_type>(nullptr, op);
+  websocketpp::frame::basic_header header(op, payload.size(), true, false,
+                                          compressed);
+  websocketpp::frame::extended_header extended(payload.size());
+  msg->set_header(websocketpp::frame::prepare_header(header, extended));
+  msg->get_raw_payload() = std::move(payload);
+  msg->set_compressed(compressed);
+  msg->set_prepared(true);
+  return msg;
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+// A decimal number held exactly as a count of 1e-8 units.
+//
+// Prices, amounts, tick sizes and lot sizes are all decimals on the exchange,
+// and none of them needs more than 8 places. Held this way, "is this price
+// on the tick grid" is an integer remainder and a price's level on the grid
+// is an integer index, with no tolerance to pick and no 0.1 + 0.2 surprises.
+// The range is about +/-9.2e10, which covers any price or amount we see.
+//
+// Parsing and formatting work on caller-provided buffers and never allocate.
+class decimal {
+public:
+  static constexpr int places = 8;
+  static constexpr int64_t scale = 100000000;
+  // Longest formatted value: sign, 11 integer digits, point, 8 places
+  static constexpr size_t max_chars = 21;
+
+  constexpr decimal() : m_units(0) {}
+
+  static constexpr decimal from_units(int64_t units) { return decimal(units); }
+
+  // Parses a JSON number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+  // Fails if the text is malformed (".5", "1.", "01"), out of range, or has
+  // nonzero digits past the 8th decimal place; it never rounds.
+  static bool parse(const char *begin, const char *end, decimal &out) {
+    const char *p = begin;
+    bool negative = p != end && *p == '-';
+    if (negative) {
+      ++p;
+    }
+    if (!is_digit(p, end) || (*p == '0' && is_digit(p + 1, end))) {
+      return false;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0;   // significant digits in mantissa
+    int exponent = 0; // value = mantissa * 10^exponent
+    for (; is_digit(p, end); ++p) {
+      if (!push_digit(mantissa, digits, *p)) {
+        return false;
+      }
+    }
+    if (p != end && *p == '.') {
+      if (!is_digit(++p, end)) {
+        return false;
+      }
+      for (; is_digit(p, end); ++p) {
+        if (!push_digit(mantissa, digits, *p)) {
+          return false;
+        }
+        --exponent;
+      }
+    }
+    if (p != end && (*p == 'e' || *p == 'E')) {
+      ++p;
+      bool negative_exp = p != end && *p == '-';
+      if (p != end && (*p == '-' || *p == '+')) {
+        ++p;
+      }
+      if (!is_digit(p, end)) {
+        return false;
+      }
+      int e = 0;
+      for (; is_digit(p, end); ++p) {
+        if (e < 1000) {
+          e = e * 10 + (*p - '0');
+        }
+      }
+      exponent += negative_exp ? -e : e;
+    }
+    if (p != end) {
+      return false;
+    }
+
+    // Rescale from 10^exponent to 10^-places
+    for (int shift = exponent + places; shift < 0; ++shift) {
+      if (mantissa % 10 != 0) {
+        return false;
+      }
+      mantissa /= 10;
+    }
+    for (int shift = exponent + places; shift > 0 && mantissa != 0; --shift) {
+      if (mantissa > UINT64_MAX / 10) {
+        return false;
+      }
+      mantissa *= 10;
+    }
+    if (mantissa > static_cast<uint64_t>(INT64_MAX)) {
+      return false;
+    }
+    out.m_units = negative ? -static_cast<int64_t>(mantissa)
+                           : static_cast<int64_t>(mantissa);
+    return true;
+  }
+
+  // The decimal a double was written as, taking its shortest round-trip
+  // text. Exact for any value written with up to 15 significant digits and
+  // 8 places; fails for non-finite values and ones that need more places.
+  static bool from_double(double value, decimal &out) {
+    if (!std::isfinite(value)) {
+      return false;
+    }
+    char text[32];
+    int n = 0;
+    for (int precision = 15; precision <= 17; ++precision) {
+      n = std::snprintf(text, sizeof(text), "%.*g", precision, value);
+      if (std::strtod(text, nullptr) == value) {
+        break;
+      }
+    }
+    return parse(text, text + n, out);
+  }
+
+  int64_t units() const { return m_units; }
+
+  // Nearest double. Division by an exact power of ten is correctly rounded,
+  // so this gives back the value from_double() was given.
+  double to_double() const { return static_cast<double>(m_units) / scale; }
+
+  // Writes the shortest text for the value, without a trailing point or
+  // zeros, into at least max_chars bytes. Returns the end of the text.
+  char *format(char *out) const {
+    uint64_t magnitude = m_units < 0 ? 0 - static_cast<uint64_t>(m_units)
+                                     : static_cast<uint64_t>(m_units);
+    if (m_units < 0) {
+      *out++ = '-';
+    }
+    uint64_t whole = magnitude / scale;
+    uint64_t fraction = magnitude % scale;
+
+    char digits[20];
+    int n = 0;
+    do {
+      digits[n++] = static_cast<char>('0' + whole % 10);
+      whole /= 10;
+    } while (whole != 0);
+    while (n > 0) {
+      *out++ = digits[--n];
+    }
+
+    if (fraction != 0) {
+      int width = places;
+      while (fraction % 10 == 0) {
+        fraction /= 10;
+        --width;
+      }
+      *out++ = '.';
+      for (int i = width - 1; i >= 0; --i) {
+        out[i] = static_cast<char>('0' + fraction % 10);
+        fraction /= 10;
+      }
+      out += width;
+    }
+    return out;
+  }
+
+  std::string to_string() const {
+    char text[max_chars];
+    return std::string(text, format(text));
+  }
+
+  // Whole number of `step`s in this value. False if it is not a multiple of
+  // `step` or `step` is not positive.
+  bool steps(decimal step, int64_t &count) const {
+    if (step.m_units <= 0 || m_units % step.m_units != 0) {
+      return false;
+    }
+    count = m_units / step.m_units;
+    return true;
+  }
+
+  // Nearest multiple of a positive `step`, halves rounded away from zero;
+  // the multiple toward zero if that one is out of range
+  decimal round_to(decimal step) const {
+    int64_t count = m_units / step.m_units;
+    int64_t remainder = m_units % step.m_units;
+    int64_t magnitude = remainder < 0 ? -remainder : remainder;
+    int64_t rounded;
+    if (magnitude >= step.m_units - magnitude &&
+        !__builtin_mul_overflow(count + (m_units < 0 ? -1 : 1), step.m_units,
+                                &rounded)) {
+      return decimal(rounded);
+    }
+    return decimal(count * step.m_units);
+  }
+
+  friend bool operator==(decimal a, decimal b) {
+    return a.m_units == b.m_units;
+  }
+  friend bool operator!=(decimal a, decimal b) {
+    return a.m_units != b.m_units;
+  }
+  friend bool operator<(decimal a, decimal b) { return a.m_units < b.m_units; }
+  friend bool operator>(decimal a, decimal b) { return a.m_units > b.m_units; }
+  friend bool operator<=(decimal a, decimal b) {
+    return a.m_units <= b.m_units;
+  }
+  friend bool operator>=(decimal a, decimal b) {
+    return a.m_units >= b.m_units;
+  }
+
+private:
+  explicit constexpr decimal(int64_t units) : m_units(units) {}
+
+  static bool is_digit(const char *p, const char *end) {
+    return p != end && *p >= '0' && *p <= '9';
+  }
+
+  // Appends a digit, ignoring leading zeros. Fails past 19 significant
+  // digits, which could overflow.
+  static bool push_digit(uint64_t &mantissa, int &digits, char c) {
+    if (mantissa == 0 && c == '0') {
+      return true;
+    }
+    if (++digits > 19) {
+      return false;
+    }
+    mantissa = mantissa * 10 + (c - '0');
+    return true;
+  }
+
+  int64_t m_units;
+};
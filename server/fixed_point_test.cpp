@@ -0,0 +1,166 @@
+// Unit tests for decimal, which carries every price and amount, and for
+// reading it from client JSON. Run with `make test`.
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE fixed_point
+#include <boost/test/unit_test.hpp>
+
+#include "fixed_point.hpp"
+#include "protocol.hpp"
+#include <cstring>
+#include <string>
+
+static bool parse(const char *text, decimal &out) {
+  return decimal::parse(text, text + std::strlen(text), out);
+}
+
+static int64_t units(const char *text) {
+  decimal d;
+  BOOST_REQUIRE_MESSAGE(parse(text, d), "failed to parse " << text);
+  return d.units();
+}
+
+static bool rejects(const char *text) {
+  decimal d;
+  return !parse(text, d);
+}
+
+BOOST_AUTO_TEST_CASE(parses_plain_numbers) {
+  BOOST_CHECK_EQUAL(units("0"), 0);
+  BOOST_CHECK_EQUAL(units("-0"), 0);
+  BOOST_CHECK_EQUAL(units("1"), 100000000);
+  BOOST_CHECK_EQUAL(units("0.5"), 50000000);
+  BOOST_CHECK_EQUAL(units("0.10"), 10000000);
+  BOOST_CHECK_EQUAL(units("50000.5"), 5000050000000);
+  BOOST_CHECK_EQUAL(units("-2.25"), -225000000);
+  BOOST_CHECK_EQUAL(units("-0.00000001"), -1);
+}
+
+BOOST_AUTO_TEST_CASE(parses_exponents) {
+  BOOST_CHECK_EQUAL(units("1e-8"), 1);
+  BOOST_CHECK_EQUAL(units("2.5E+3"), 250000000000);
+  BOOST_CHECK_EQUAL(units("-1.5e2"), -15000000000);
+  BOOST_CHECK_EQUAL(units("0e999999"), 0);
+  BOOST_CHECK_EQUAL(units("1000e-11"), 1);
+}
+
+BOOST_AUTO_TEST_CASE(fractional_places) {
+  BOOST_CHECK_EQUAL(units("0.12345678"), 12345678);
+  // Zeros past the 8th place are exact; anything else would need rounding
+  BOOST_CHECK_EQUAL(units("0.1234567800"), 12345678);
+  BOOST_CHECK(rejects("0.123456789"));
+  BOOST_CHECK(rejects("0.000000001"));
+  BOOST_CHECK(rejects("1e-9"));
+}
+
+BOOST_AUTO_TEST_CASE(range) {
+  // INT64_MAX units is the largest value
+  BOOST_CHECK_EQUAL(units("92233720368.54775807"), INT64_MAX);
+  BOOST_CHECK_EQUAL(units("-92233720368.54775807"), -INT64_MAX);
+  BOOST_CHECK(rejects("92233720368.54775808"));
+  BOOST_CHECK(rejects("100000000000"));
+  BOOST_CHECK(rejects("1e11"));
+  BOOST_CHECK(rejects("1e400"));
+  // More than 19 significant digits can't be held, even when small
+  BOOST_CHECK(rejects("0.12345678901234567890"));
+  // Leading zeros in the fraction are not significant
+  BOOST_CHECK_EQUAL(units("0.00000001"), 1);
+}
+
+BOOST_AUTO_TEST_CASE(rejects_malformed_numbers) {
+  const char *const malformed[] = {
+      "",   "-",  ".5", "-.5", "1.",    "00", "01",   "00.10", "-01", "1e",
+      "1e+", "e5", "+1", "1.2.3", "1 ", " 1", "0x10", "NaN",  "inf", "1,5"};
+  for (const char *text : malformed) {
+    BOOST_CHECK_MESSAGE(rejects(text), "accepted " << '"' << text << '"');
+  }
+}
+
+BOOST_AUTO_TEST_CASE(formats_shortest_text) {
+  BOOST_CHECK_EQUAL(decimal().to_string(), "0");
+  BOOST_CHECK_EQUAL(decimal::from_units(1).to_string(), "0.00000001");
+  BOOST_CHECK_EQUAL(decimal::from_units(-1).to_string(), "-0.00000001");
+  BOOST_CHECK_EQUAL(decimal::from_units(150000000).to_string(), "1.5");
+  BOOST_CHECK_EQUAL(decimal::from_units(5000000000000).to_string(), "50000");
+  BOOST_CHECK_EQUAL(decimal::from_units(INT64_MAX).to_string(),
+                    "92233720368.54775807");
+  BOOST_CHECK_EQUAL(decimal::from_units(INT64_MIN).to_string(),
+                    "-92233720368.54775808");
+  BOOST_CHECK_EQUAL(decimal::from_units(INT64_MIN).to_string().size(),
+                    decimal::max_chars);
+}
+
+BOOST_AUTO_TEST_CASE(format_round_trips) {
+  const char *const values[] = {"0.1", "-0.3", "123.45678901", "50000",
+                                "92233720368.54775807"};
+  for (const char *text : values) {
+    decimal d;
+    BOOST_REQUIRE(parse(text, d));
+    BOOST_CHECK_EQUAL(d.to_string(), text);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(from_double_takes_the_written_decimal) {
+  decimal d;
+  BOOST_REQUIRE(decimal::from_double(0.1, d));
+  BOOST_CHECK_EQUAL(d.units(), 10000000);
+  // 0.30000000000000004 needs 17 places
+  BOOST_CHECK(!decimal::from_double(0.1 + 0.2, d));
+  BOOST_REQUIRE(decimal::from_double(-50000.5, d));
+  BOOST_CHECK_EQUAL(d.units(), -5000050000000);
+  BOOST_REQUIRE(decimal::from_double(1e-8, d));
+  BOOST_CHECK_EQUAL(d.units(), 1);
+  BOOST_REQUIRE(decimal::from_double(0.00025, d));
+  BOOST_CHECK_EQUAL(d.to_double(), 0.00025);
+
+  BOOST_CHECK(!decimal::from_double(1e-9, d));
+  BOOST_CHECK(!decimal::from_double(1e12, d));
+  BOOST_CHECK(!decimal::from_double(std::nan(""), d));
+  BOOST_CHECK(!decimal::from_double(HUGE_VAL, d));
+}
+
+BOOST_AUTO_TEST_CASE(steps) {
+  decimal tick;
+  BOOST_REQUIRE(parse("0.5", tick));
+  int64_t count = 0;
+  BOOST_CHECK(decimal::from_units(250000000).steps(tick, count));
+  BOOST_CHECK_EQUAL(count, 5);
+  BOOST_CHECK(!decimal::from_units(260000000).steps(tick, count));
+  BOOST_CHECK(!decimal::from_units(1).steps(decimal(), count));
+}
+
+BOOST_AUTO_TEST_CASE(round_to) {
+  decimal tick;
+  BOOST_REQUIRE(parse("0.5", tick));
+  BOOST_CHECK_EQUAL(decimal::from_units(260000000).round_to(tick).to_string(),
+                    "2.5");
+  BOOST_CHECK_EQUAL(decimal::from_units(275000000).round_to(tick).to_string(),
+                    "3");
+  BOOST_CHECK_EQUAL(decimal::from_units(-275000000).round_to(tick).to_string(),
+                    "-3");
+  BOOST_CHECK_EQUAL(decimal::from_units(-1).round_to(tick).units(), 0);
+  BOOST_CHECK_EQUAL(decimal::from_units(250000000).round_to(tick).units(),
+                    250000000);
+  // Rounding up would leave the range
+  BOOST_CHECK_EQUAL(decimal::from_units(INT64_MAX).round_to(tick).units(),
+                    INT64_MAX / 50000000 * 50000000);
+}
+
+BOOST_AUTO_TEST_CASE(inexact_number_flags_misread_numbers) {
+  BOOST_CHECK_EQUAL(inexact_number(R"({"price":50000.5,"amount":10})"), "");
+  // Up to 15 significant digits read back as written, even when invalid
+  BOOST_CHECK_EQUAL(inexact_number(R"({"price":0.000000001})"), "");
+  BOOST_CHECK_EQUAL(inexact_number(R"({"price":12345678.12345678})"), "");
+  // The double rounds away a nonzero place past the 8th
+  BOOST_CHECK_EQUAL(
+      inexact_number(R"({"data":[{"price":50000.00000000000001}]})"),
+      "50000.00000000000001");
+  // Valid, but too many digits for a double
+  BOOST_CHECK_EQUAL(inexact_number(R"({"price":12345678901.23456789})"),
+                    "12345678901.23456789");
+  BOOST_CHECK_EQUAL(inexact_number(R"({"price":5000000000000000000.5e-10})"),
+                    "5000000000000000000.5e-10");
+  // Strings are skipped, escaped quotes included
+  BOOST_CHECK_EQUAL(
+      inexact_number(R"({"label":"\"12345678901.23456789","price":1})"), "");
+}
@@ -0,0 +1,342 @@
+#pragma once
+
+#include "fixed_point.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Dense index of an instrument in the registry's table
+typedef uint32_t instrument_id;
+static const instrument_id no_instrument = UINT32_MAX;
+
+enum class instrument_kind : uint8_t {
+  unknown,
+  future,
+  option,
+  spot,
+  future_combo,
+  option_combo
+};
+
+inline instrument_kind parse_instrument_kind(const std::string &kind) {
+  if (kind == "future") {
+    return instrument_kind::future;
+  } else if (kind == "option") {
+    return instrument_kind::option;
+  } else if (kind == "spot") {
+    return instrument_kind::spot;
+  } else if (kind == "future_combo") {
+    return instrument_kind::future_combo;
+  } else if (kind == "option_combo") {
+    return instrument_kind::option_combo;
+  }
+  return instrument_kind::unknown;
+}
+
+// Currencies public/get_instruments accepts
+inline bool known_currency(const std::string &currency) {
+  static const char *const currencies[] = {"BTC",  "ETH",  "USDC",
+                                           "USDT", "EURR", "any"};
+  for (const char *known : currencies) {
+    if (currency == known) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Instrument reference data, one list per (currency, kind) as returned by
+// public/get_instruments.
+//
+// Every instrument seen gets a dense instrument_id, assigned once and never
+// reused, so code past the protocol edge can index arrays instead of hashing
+// names. Attributes live in a struct-of-arrays table indexed by ID, sizes
+// as exact decimals; they are relaxed atomics because a refresh may rewrite
+// them while other threads read. Names are written before their ID is handed
+// out and never change. Once max_instruments IDs are out, instruments not
+// seen before get none: they are still in their list's reply but not in its
+// IDs, and find() doesn't know them.
+//
+// Each list keeps its client reply already serialized, so a get_instruments
+// request is a map lookup and a shared_ptr copy. Lists are replaced whole
+// when refreshed; readers holding the old reply or IDs keep them alive.
+//
+// The registry persists to a JSON snapshot so a restart can serve and poll
+// instruments before the exchange has answered. A snapshot taken against a
+// different exchange URL is ignored.
+class instrument_registry {
+public:
+  typedef std::vector<instrument_id> id_list;
+
+  // The table is allocated up front so IDs stay valid without locking
+  static const instrument_id max_instruments = 1 << 14;
+
+  instrument_registry(std::string snapshot_path, std::string exchange_url)
+      : m_snapshot_path(std::move(snapshot_path)),
+        m_exchange_url(std::move(exchange_url)),
+        m_names(new std::string[max_instruments]),
+        m_tick_size(new std::atomic<int64_t>[max_instruments]()),
+        m_contract_size(new std::atomic<int64_t>[max_instruments]()),
+        m_min_trade_amount(new std::atomic<int64_t>[max_instruments]()),
+        m_kind(new std::atomic<instrument_kind>[max_instruments]()),
+        m_usd_amounts(new std::atomic<bool>[max_instruments]()) {}
+
+  // Loads the snapshot if there is one for this exchange. Returns the number
+  // of lists loaded.
+  size_t load() {
+    std::ifstream in(m_snapshot_path);
+    if (!in) {
+      return 0;
+    }
+    nlohmann::json snapshot = nlohmann::json::parse(in, nullptr, false);
+    if (!snapshot.is_object() ||
+        snapshot.value("exchange_url", std::string()) != m_exchange_url) {
+      return 0;
+    }
+    size_t loaded = 0;
+    for (auto &list : snapshot.value("lists", nlohmann::json::array())) {
+      if (list.contains("currency") && list["currency"].is_string() &&
+          list.contains("kind") && list["kind"].is_string() &&
+          list.contains("result") && list["result"].is_array()) {
+        set(list["currency"].get<std::string>(),
+            list["kind"].get<std::string>(), std::move(list["result"]),
+            list.value("fetched_ms", int64_t(0)));
+        ++loaded;
+      }
+    }
+    return loaded;
+  }
+
+  // Writes every list to the snapshot, replacing it atomically
+  void save() const {
+    nlohmann::json lists = nlohmann::json::array();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (const auto &it : m_lists) {
+        lists.push_back({{"currency", it.first.first},
+                         {"kind", it.first.second},
+                         {"fetched_ms", it.second.fetched_ms},
+                         {"result", *it.second.result}});
+      }
+    }
+    nlohmann::json snapshot = {
+        {"exchange_url", m_exchange_url}, {"lists", std::move(lists)}};
+
+    std::string tmp = m_snapshot_path + ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::trunc);
+      out << snapshot.dump();
+      if (!out) {
+        return;
+      }
+    }
+    std::rename(tmp.c_str(), m_snapshot_path.c_str());
+  }
+
+  // Replaces a list from the body of a get_instruments response. Returns
+  // false, leaving the list as it was, if the body has no result.
+  bool update(const std::string &currency, const std::string &kind,
+              const std::string &exchange_body) {
+    nlohmann::json response =
+        nlohmann::json::parse(exchange_body, nullptr, false);
+    if (!response.is_object() || !response.contains("result") ||
+        !response["result"].is_array()) {
+      return false;
+    }
+    set(currency, kind, std::move(response["result"]),
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count());
+    return true;
+  }
+
+  // The instruments reply for a client, or null if the list is not loaded
+  std::shared_ptr<const std::string> response(const std::string &currency,
+                                              const std::string &kind) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_lists.find({currency, kind});
+    return it == m_lists.end() ? nullptr : it->second.response;
+  }
+
+  // IDs of the instruments in a list, or null if the list is not loaded
+  std::shared_ptr<const id_list> ids(const std::string &currency,
+                                     const std::string &kind) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_lists.find({currency, kind});
+    return it == m_lists.end() ? nullptr : it->second.ids;
+  }
+
+  // ID of an instrument, or no_instrument if it has never been seen
+  instrument_id find(const std::string &name) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_ids.find(name);
+    return it == m_ids.end() ? no_instrument : it->second;
+  }
+
+  // ID of an instrument, assigning one if it has never been seen. Its
+  // attributes stay zero until a list containing it is loaded. Returns
+  // no_instrument if it is new and the table is full.
+  instrument_id intern(const std::string &name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return intern_locked(name);
+  }
+
+  // IDs assigned so far run from 0 to size() - 1
+  instrument_id size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return static_cast<instrument_id>(m_ids.size());
+  }
+
+  const std::string &name(instrument_id id) const { return m_names[id]; }
+  decimal tick_size(instrument_id id) const {
+    return decimal::from_units(m_tick_size[id].load(std::memory_order_relaxed));
+  }
+  decimal contract_size(instrument_id id) const {
+    return decimal::from_units(
+        m_contract_size[id].load(std::memory_order_relaxed));
+  }
+  decimal min_trade_amount(instrument_id id) const {
+    return decimal::from_units(
+        m_min_trade_amount[id].load(std::memory_order_relaxed));
+  }
+  instrument_kind kind(instrument_id id) const {
+    return m_kind[id].load(std::memory_order_relaxed);
+  }
+
+  // Whether order amounts are in USD, as for inverse futures, rather than
+  // in the base currency, as for options, spot and linear futures
+  bool usd_amounts(instrument_id id) const {
+    return m_usd_amounts[id].load(std::memory_order_relaxed);
+  }
+
+  // The lot: the step an order amount must be a multiple of. Futures trade
+  // in whole contracts, so it is the contract size; other amounts go in
+  // steps of the minimum trade amount. Zero, meaning unchecked, if the list
+  // didn't give it.
+  decimal lot_size(instrument_id id) const {
+    instrument_kind k = kind(id);
+    return k == instrument_kind::future || k == instrument_kind::future_combo
+               ? contract_size(id)
+               : min_trade_amount(id);
+  }
+
+  // The (currency, kind) of every loaded list, for refreshing
+  std::vector<std::pair<std::string, std::string>> lists() const {
+    std::vector<std::pair<std::string, std::string>> keys;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto &it : m_lists) {
+      keys.push_back(it.first);
+    }
+    return keys;
+  }
+
+private:
+  struct entry {
+    std::shared_ptr<const nlohmann::json> result;
+    std::shared_ptr<const std::string> response;
+    std::shared_ptr<const id_list> ids;
+    int64_t fetched_ms;
+  };
+
+  instrument_id intern_locked(const std::string &name) {
+    auto it = m_ids.find(name);
+    if (it != m_ids.end()) {
+      return it->second;
+    }
+    if (m_ids.size() == max_instruments) {
+      return no_instrument;
+    }
+    instrument_id id = static_cast<instrument_id>(m_ids.size());
+    m_names[id] = name;
+    m_ids.emplace(name, id);
+    return id;
+  }
+
+  // A size attribute in decimal units; 0, meaning unchecked, if missing,
+  // not a number or not representable
+  static int64_t size_units(const nlohmann::json &instrument,
+                            const char *field) {
+    auto it = instrument.find(field);
+    decimal size;
+    return it != instrument.end() && it->is_number() &&
+                   decimal::from_double(it->get<double>(), size)
+               ? size.units()
+               : 0;
+  }
+
+  // Builds the reply outside the lock, then assigns IDs, updates the table
+  // and swaps the list in. Entries without a name, or past a full table,
+  // get no ID; nothing here throws on what the exchange sent, so a list is
+  // never left half applied.
+  void set(const std::string &currency, const std::string &kind,
+           nlohmann::json result, int64_t fetched_ms) {
+    entry e;
+    e.response = std::make_shared<const std::string>(
+        nlohmann::json{{"jsonrpc", "2.0"},
+                       {"type", "instruments"},
+                       {"result", result}}
+            .dump());
+    e.fetched_ms = fetched_ms;
+
+    auto ids = std::make_shared<id_list>();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto &instrument : result) {
+      if (!instrument.is_object()) {
+        continue;
+      }
+      auto name = instrument.find("instrument_name");
+      if (name == instrument.end() || !name->is_string()) {
+        continue;
+      }
+      instrument_id id = intern_locked(name->get<std::string>());
+      if (id == no_instrument) {
+        continue;
+      }
+      auto kind_field = instrument.find("kind");
+      instrument_kind parsed_kind = instrument_kind::unknown;
+      if (kind_field != instrument.end() && kind_field->is_string()) {
+        parsed_kind = parse_instrument_kind(kind_field->get<std::string>());
+      }
+      m_tick_size[id].store(size_units(instrument, "tick_size"),
+                            std::memory_order_relaxed);
+      m_contract_size[id].store(size_units(instrument, "contract_size"),
+                                std::memory_order_relaxed);
+      m_min_trade_amount[id].store(size_units(instrument, "min_trade_amount"),
+                                   std::memory_order_relaxed);
+      m_kind[id].store(parsed_kind, std::memory_order_relaxed);
+      auto type = instrument.find("instrument_type");
+      bool linear = type != instrument.end() && *type == "linear";
+      bool future = parsed_kind == instrument_kind::future ||
+                    parsed_kind == instrument_kind::future_combo;
+      m_usd_amounts[id].store(future && !linear, std::memory_order_relaxed);
+      ids->push_back(id);
+    }
+    e.ids = std::move(ids);
+    e.result = std::make_shared<const nlohmann::json>(std::move(result));
+    m_lists[{currency, kind}] = std::move(e);
+  }
+
+  std::string m_snapshot_path;
+  std::string m_exchange_url;
+  mutable std::mutex m_mutex;
+  std::map<std::pair<std::string, std::string>, entry> m_lists;
+  std::unordered_map<std::string, instrument_id> m_ids;
+
+  // Instrument table, indexed by instrument_id
+  std::unique_ptr<std::string[]> m_names;
+  std::unique_ptr<std::atomic<int64_t>[]> m_tick_size;
+  std::unique_ptr<std::atomic<int64_t>[]> m_contract_size;
+  std::unique_ptr<std::atomic<int64_t>[]> m_min_trade_amount;
+  std::unique_ptr<std::atomic<instrument_kind>[]> m_kind;
+  std::unique_ptr<std::atomic<bool>[]> m_usd_amounts;
+};
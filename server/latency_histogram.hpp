@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <vector>
+
+// Log-linear histogram of latency samples, in the style of HdrHistogram.
+//
+// Values below 2^precision_bits are counted exactly. Above that each power
+// of two is split into 2^(precision_bits - 1) equal buckets, so every
+// recorded value is reproduced to within a relative error of
+// 2^-(precision_bits - 1) while memory stays proportional to the log of the
+// largest trackable value. Recording is a couple of shifts and an increment.
+//
+// Units are whatever the caller records; the benchmarks use nanoseconds.
+// Not thread safe: give each recording thread its own histogram and merge.
+class latency_histogram {
+public:
+  explicit latency_histogram(uint64_t highest = 60ull * 1000 * 1000 * 1000,
+                             int precision_bits = 11)
+      : m_bits(precision_bits), m_half(uint64_t(1) << (precision_bits - 1)),
+        m_highest(std::max<uint64_t>(highest, m_half * 2)),
+        m_counts(index_of(m_highest) + 1, 0) {}
+
+  // Values above the highest trackable value are clamped to it, but max()
+  // still reports them exactly.
+  void record(uint64_t value, uint64_t count = 1) {
+    m_total += count;
+    m_min = std::min(m_min, value);
+    m_max = std::max(m_max, value);
+    m_sum += static_cast<double>(value) * count;
+    m_counts[index_of(std::min(value, m_highest))] += count;
+  }
+
+  void merge(const latency_histogram &other) {
+    if (other.m_bits != m_bits || other.m_counts.size() != m_counts.size()) {
+      for (size_t i = 0; i < other.m_counts.size(); ++i) {
+        if (other.m_counts[i]) {
+          record(highest_equivalent(other, i), other.m_counts[i]);
+        }
+      }
+      return;
+    }
+    for (size_t i = 0; i < m_counts.size(); ++i) {
+      m_counts[i] += other.m_counts[i];
+    }
+    m_total += other.m_total;
+    m_sum += other.m_sum;
+    m_min = std::min(m_min, other.m_min);
+    m_max = std::max(m_max, other.m_max);
+  }
+
+  void reset() {
+    std::fill(m_counts.begin(), m_counts.end(), 0);
+    m_total = 0;
+    m_sum = 0;
+    m_min = std::numeric_limits<uint64_t>::max();
+    m_max = 0;
+  }
+
+  uint64_t count() const { return m_total; }
+  uint64_t min() const { return m_total ? m_min : 0; }
+  uint64_t max() const { return m_max; }
+  double mean() const { return m_total ? m_sum / m_total : 0; }
+
+  // Smallest value v such that `percentile` percent of samples are <= v,
+  // reported as the top of its bucket and never above max().
+  uint64_t percentile(double percentile) const {
+    if (m_total == 0) {
+      return 0;
+    }
+    double fraction = std::min(std::max(percentile, 0.0), 100.0) / 100.0;
+    uint64_t target = std::max<uint64_t>(
+        1, static_cast<uint64_t>(fraction * m_total + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < m_counts.size(); ++i) {
+      seen += m_counts[i];
+      if (seen >= target) {
+        // The last bucket also holds clamped values
+        return i + 1 == m_counts.size()
+                   ? m_max
+                   : std::min(highest_equivalent(*this, i), m_max);
+      }
+    }
+    return m_max;
+  }
+
+  // Writes the distribution in HdrHistogram's percentile output format, so
+  // it can be plotted with the usual tools. Values are divided by `scale`
+  // (e.g. 1000 to print nanosecond samples as microseconds).
+  void dump(std::ostream &out, double scale = 1.0,
+            int ticks_per_half_distance = 5) const {
+    out << std::setw(12) << "Value" << " " << std::setw(14) << "Percentile"
+        << " " << std::setw(10) << "TotalCount" << " " << std::setw(14)
+        << "1/(1-Percentile)" << "\n\n";
+
+    std::ios::fmtflags flags = out.flags();
+    out << std::fixed;
+
+    // Halve the remaining distance to 100% at each step, printing
+    // `ticks_per_half_distance` rows per halving, as HdrHistogram does.
+    for (int half = 0; m_total && half < 48; ++half) {
+      double low = 100.0 - 100.0 / (uint64_t(1) << half);
+      double span = 100.0 / (uint64_t(1) << (half + 1));
+      for (int tick = 0; tick < ticks_per_half_distance; ++tick) {
+        write_row(out, low + span * tick / ticks_per_half_distance, scale);
+      }
+      if (count_at_or_below(this->percentile(low + span)) == m_total) {
+        break;
+      }
+    }
+    write_row(out, 100.0, scale);
+
+    out << std::setprecision(3) << "#[Mean    = " << std::setw(12)
+        << mean() / scale << ", Max        = " << std::setw(12)
+        << m_max / scale << "]\n"
+        << "#[Min     = " << std::setw(12) << min() / scale
+        << ", Total count = " << std::setw(12) << m_total << "]\n";
+    out.flags(flags);
+  }
+
+private:
+  size_t index_of(uint64_t value) const {
+    int msb = value ? 63 - __builtin_clzll(value) : 0;
+    int shift = std::max(0, msb - (m_bits - 1));
+    return static_cast<size_t>(shift * m_half + (value >> shift));
+  }
+
+  static uint64_t highest_equivalent(const latency_histogram &h, size_t index) {
+    if (index < h.m_half * 2) {
+      return index;
+    }
+    uint64_t shift = index / h.m_half - 1;
+    uint64_t mantissa = index - shift * h.m_half;
+    return ((mantissa + 1) << shift) - 1;
+  }
+
+  uint64_t count_at_or_below(uint64_t value) const {
+    uint64_t seen = 0;
+    size_t last = index_of(std::min(value, m_highest));
+    for (size_t i = 0; i <= last; ++i) {
+      seen += m_counts[i];
+    }
+    return seen;
+  }
+
+  void write_row(std::ostream &out, double percentile, double scale) const {
+    uint64_t value = this->percentile(percentile);
+    double fraction = percentile / 100.0;
+    out << std::setprecision(3) << std::setw(12) << value / scale << " "
+        << std::setprecision(12) << std::setw(14) << fraction << " "
+        << std::setw(10) << count_at_or_below(value) << " ";
+    if (fraction < 1.0) {
+      out << std::setprecision(2) << std::setw(14) << 1.0 / (1.0 - fraction);
+    }
+    out << "\n";
+  }
+
+  int m_bits;
+  uint64_t m_half;
+  uint64_t m_highest;
+  std::vector<uint64_t> m_counts;
+  uint64_t m_total = 0;
+  double m_sum = 0;
+  uint64_t m_min = std::numeric_limits<uint64_t>::max();
+  uint64_t m_max = 0;
+};
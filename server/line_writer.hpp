@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Appends whole lines to a stream from any thread without waiting on the
+// stream.
+//
+// Unlike async_logger, lines are written exactly as given, each followed by
+// a newline, with no prefix and no length limit, so the output can be read
+// back as JSONL. write() moves the line into a batch under a mutex held only
+// for the push; a background thread swaps the batch out and writes it. When
+// `max_queued` lines are waiting, further lines are dropped and counted.
+class line_writer {
+public:
+  // `out` must outlive the writer
+  explicit line_writer(std::ostream *out, size_t max_queued = 65536)
+      : m_out(out), m_max_queued(max_queued),
+        m_drain_thread(&line_writer::drain_loop, this) {}
+
+  // Writes out whatever is still queued
+  ~line_writer() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_running = false;
+    }
+    m_ready.notify_one();
+    m_drain_thread.join();
+  }
+
+  line_writer(const line_writer &) = delete;
+  line_writer &operator=(const line_writer &) = delete;
+
+  void write(std::string line) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_queued.size() >= m_max_queued) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      m_queued.push_back(std::move(line));
+    }
+    m_ready.notify_one();
+  }
+
+  // Lines lost because the queue was full
+  uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+  void drain_loop() {
+    std::vector<std::string> batch;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+      m_ready.wait(lock, [this] { return !m_running || !m_queued.empty(); });
+      if (m_queued.empty()) {
+        return; // stopping, and nothing left
+      }
+      batch.swap(m_queued);
+      lock.unlock();
+      for (const std::string &line : batch) {
+        m_out->write(line.data(), line.size());
+        m_out->put('\n');
+      }
+      m_out->flush();
+      batch.clear();
+      lock.lock();
+    }
+  }
+
+  std::ostream *m_out;
+  const size_t m_max_queued;
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::vector<std::string> m_queued;
+  bool m_running = true;
+  std::atomic<uint64_t> m_dropped{0};
+  std::thread m_drain_thread;
+};
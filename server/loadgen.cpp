@@ -0,0 +1,373 @@
+// Open-loop load generator for the websocket server.
+//
+// The echo benchmark sends one message and waits for the reply, so when the
+// server stalls the benchmark simply stops sending and the stall shows up as
+// one slow sample (coordinated omission). This tool instead drives a fixed
+// aggregate message rate over N connections regardless of how quickly
+// replies arrive, and measures each reply against the time its request was
+// *supposed* to be sent. Queueing inside the server therefore shows up in the
+// percentiles, and stepping through increasing rates shows where it
+// saturates.
+//
+// Messages are `echo` requests that carry their intended send time; the
+// server returns the payload verbatim.
+
+#include "latency_histogram.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <websocketpp/client.hpp>
+#include <websocketpp/config/asio_no_tls_client.hpp>
+
+typedef websocketpp::client<websocketpp::config::asio_client> client;
+typedef std::chrono::steady_clock steady;
+
+namespace {
+
+int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             steady::now().time_since_epoch())
+      .count();
+}
+
+struct step_result {
+  latency_histogram latencies;
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  uint64_t send_errors = 0;
+  // How far behind schedule the generator itself fell. If this grows, the
+  // generator rather than the server is the bottleneck.
+  int64_t max_send_lag_ns = 0;
+
+  void merge(const step_result &other) {
+    latencies.merge(other.latencies);
+    sent += other.sent;
+    received += other.received;
+    send_errors += other.send_errors;
+    max_send_lag_ns = std::max(max_send_lag_ns, other.max_send_lag_ns);
+  }
+};
+
+// One client endpoint and io thread driving a share of the connections.
+//
+// Everything below runs on the worker's own io thread, so no state is shared
+// with other workers; the coordinator only talks to it through post().
+class worker {
+public:
+  worker(const std::string &padding) : m_padding(padding) {
+    m_client.clear_access_channels(websocketpp::log::alevel::all);
+    m_client.clear_error_channels(websocketpp::log::elevel::all);
+    m_client.set_error_channels(websocketpp::log::elevel::fatal);
+    m_client.init_asio();
+    m_client.start_perpetual();
+    m_client.set_tcp_post_init_handler([this](websocketpp::connection_hdl hdl) {
+      websocketpp::lib::asio::error_code ec;
+      m_client.get_con_from_hdl(hdl)->get_raw_socket().set_option(
+          websocketpp::lib::asio::ip::tcp::no_delay(true), ec);
+    });
+    m_timer.reset(
+        new websocketpp::lib::asio::steady_timer(m_client.get_io_service()));
+    m_thread = std::thread([this] { m_client.run(); });
+  }
+
+  ~worker() {
+    m_client.stop_perpetual();
+    m_client.get_io_service().post([this] {
+      m_timer->cancel();
+      for (auto &hdl : m_connections) {
+        websocketpp::lib::error_code ec;
+        m_client.close(hdl, websocketpp::close::status::going_away, "", ec);
+      }
+    });
+    m_thread.join();
+  }
+
+  void connect(const std::string &url, std::atomic<int> &open,
+               std::atomic<int> &failed) {
+    m_client.get_io_service().post([this, url, &open, &failed] {
+      websocketpp::lib::error_code ec;
+      client::connection_ptr con = m_client.get_connection(url, ec);
+      if (ec) {
+        ++failed;
+        return;
+      }
+      con->set_open_handler([this, &open](websocketpp::connection_hdl hdl) {
+        m_connections.push_back(hdl);
+        ++open;
+      });
+      con->set_fail_handler(
+          [&failed](websocketpp::connection_hdl) { ++failed; });
+      con->set_message_handler(
+          [this](websocketpp::connection_hdl, client::message_ptr msg) {
+            on_message(msg->get_payload());
+          });
+      m_client.connect(con);
+    });
+  }
+
+  // Send `rate` messages per second, round robin over this worker's
+  // connections, starting at `start_ns` until `stop_ns`.
+  void start(int step, double rate, int64_t start_ns, int64_t stop_ns) {
+    m_client.get_io_service().post([=] {
+      m_result = step_result();
+      m_step = step;
+      m_interval_ns = 1e9 / rate;
+      m_start_ns = start_ns;
+      m_stop_ns = stop_ns;
+      m_next = 0;
+      arm(start_ns);
+    });
+  }
+
+  // Results for the current step, collected on the io thread.
+  step_result collect() {
+    std::promise<step_result> done;
+    m_client.get_io_service().post([this, &done] {
+      m_timer->cancel();
+      m_step = -1;
+      done.set_value(m_result);
+    });
+    return done.get_future().get();
+  }
+
+private:
+  int64_t intended(uint64_t n) const {
+    return m_start_ns + static_cast<int64_t>(n * m_interval_ns);
+  }
+
+  void arm(int64_t at_ns) {
+    m_timer->expires_at(steady::time_point(std::chrono::nanoseconds(at_ns)));
+    m_timer->async_wait([this](const websocketpp::lib::error_code &ec) {
+      if (!ec) {
+        on_timer();
+      }
+    });
+  }
+
+  // Send everything whose intended time has passed. Falling behind is not
+  // corrected by skipping: late sends keep their original intended time, so
+  // the delay is charged to the samples as it would be to a real client.
+  void on_timer() {
+    int64_t now = now_ns();
+    while (!m_connections.empty() && intended(m_next) <= now &&
+           intended(m_next) < m_stop_ns) {
+      int64_t at = intended(m_next);
+      m_result.max_send_lag_ns = std::max(m_result.max_send_lag_ns, now - at);
+
+      char header[96];
+      int length = std::snprintf(header, sizeof(header),
+                                 "{\"type\":\"echo\",\"step\":%d,\"t\":%lld,",
+                                 m_step, static_cast<long long>(at));
+      std::string payload(header, length);
+      payload += m_padding;
+
+      websocketpp::lib::error_code ec;
+      m_client.send(m_connections[m_next % m_connections.size()], payload,
+                    websocketpp::frame::opcode::text, ec);
+      if (ec) {
+        ++m_result.send_errors;
+      } else {
+        ++m_result.sent;
+      }
+      ++m_next;
+    }
+    if (intended(m_next) < m_stop_ns) {
+      arm(intended(m_next));
+    }
+  }
+
+  // Replies are matched by the timestamp they carry rather than parsed as
+  // JSON, so that the generator's own CPU cost stays small next to the
+  // server's. Broadcasts and replies from an earlier step are ignored.
+  void on_message(const std::string &payload) {
+    int64_t received = now_ns();
+    if (m_step < 0 || payload.compare(0, 15, "{\"type\":\"echo\",") != 0) {
+      return;
+    }
+    const char *p = payload.c_str();
+    const char *step = std::strstr(p, "\"step\":");
+    const char *t = std::strstr(p, "\"t\":");
+    if (!step || !t || std::atoi(step + 7) != m_step) {
+      return;
+    }
+    int64_t sent = std::strtoll(t + 4, nullptr, 10);
+    m_result.latencies.record(static_cast<uint64_t>(received - sent));
+    ++m_result.received;
+  }
+
+  client m_client;
+  std::thread m_thread;
+  std::unique_ptr<websocketpp::lib::asio::steady_timer> m_timer;
+  std::vector<websocketpp::connection_hdl> m_connections;
+  std::string m_padding;
+
+  step_result m_result;
+  int m_step = -1;
+  double m_interval_ns = 0;
+  int64_t m_start_ns = 0;
+  int64_t m_stop_ns = 0;
+  uint64_t m_next = 0;
+};
+
+std::vector<double> parse_rates(const std::string &list) {
+  std::vector<double> rates;
+  std::stringstream in(list);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    double rate = std::atof(item.c_str());
+    if (rate > 0) {
+      rates.push_back(rate);
+    }
+  }
+  return rates;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string url = "ws://localhost:9002";
+  int connections = 10;
+  int threads = 2;
+  std::string rates_list = "1000,2000,5000,10000,20000,50000";
+  double duration_s = 10;
+  double drain_s = 2;
+  int payload_bytes = 64;
+  double slo_us = 1000;
+  std::string histogram_dir;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--url") {
+      url = argv[i + 1];
+    } else if (flag == "--connections") {
+      connections = std::max(1, std::atoi(argv[i + 1]));
+    } else if (flag == "--threads") {
+      threads = std::max(1, std::atoi(argv[i + 1]));
+    } else if (flag == "--rates") {
+      rates_list = argv[i + 1];
+    } else if (flag == "--duration-s") {
+      duration_s = std::atof(argv[i + 1]);
+    } else if (flag == "--drain-s") {
+      drain_s = std::atof(argv[i + 1]);
+    } else if (flag == "--payload-bytes") {
+      payload_bytes = std::max(0, std::atoi(argv[i + 1]));
+    } else if (flag == "--slo-us") {
+      slo_us = std::atof(argv[i + 1]);
+    } else if (flag == "--histogram-dir") {
+      histogram_dir = argv[i + 1];
+    } else {
+      std::cerr << "usage: " << argv[0]
+                << " [--url ws://host:port] [--connections N] [--threads N]"
+                   " [--rates r1,r2,...] [--duration-s S] [--drain-s S]"
+                   " [--payload-bytes N] [--slo-us N] [--histogram-dir DIR]\n";
+      return 1;
+    }
+  }
+
+  std::vector<double> rates = parse_rates(rates_list);
+  if (rates.empty()) {
+    std::cerr << "--rates needs at least one positive rate" << std::endl;
+    return 1;
+  }
+  threads = std::min(threads, connections);
+
+  std::string padding = "\"data\":\"" + std::string(payload_bytes, 'x') + "\"}";
+  std::vector<std::unique_ptr<worker>> workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.emplace_back(new worker(padding));
+  }
+
+  std::atomic<int> open{0};
+  std::atomic<int> failed{0};
+  for (int i = 0; i < connections; ++i) {
+    workers[i % threads]->connect(url, open, failed);
+  }
+  auto deadline = steady::now() + std::chrono::seconds(10);
+  while (open + failed < connections && steady::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  if (open < connections) {
+    std::cerr << "only " << open << " of " << connections
+              << " connections opened to " << url << std::endl;
+    return 1;
+  }
+
+  std::cout << "# " << connections << " connections over " << threads
+            << " threads to " << url << ", " << duration_s
+            << "s per step, latency from intended send time (us)\n";
+  std::cout << std::setw(10) << "target/s" << std::setw(10) << "sent/s"
+            << std::setw(10) << "recv/s" << std::setw(10) << "p50"
+            << std::setw(10) << "p90" << std::setw(10) << "p99"
+            << std::setw(10) << "p99.9" << std::setw(10) << "max"
+            << std::setw(10) << "lost" << std::setw(12) << "send_lag"
+            << std::endl;
+
+  double saturation = 0;
+  for (size_t step = 0; step < rates.size(); ++step) {
+    double rate = rates[step];
+    int64_t start = now_ns() + 10 * 1000 * 1000;
+    int64_t stop = start + static_cast<int64_t>(duration_s * 1e9);
+
+    // Split the rate in proportion to each worker's share of connections
+    for (int i = 0; i < threads; ++i) {
+      int share = connections / threads + (i < connections % threads ? 1 : 0);
+      workers[i]->start(static_cast<int>(step), rate * share / connections,
+                        start, stop);
+    }
+    std::this_thread::sleep_until(
+        steady::time_point(std::chrono::nanoseconds(stop)) +
+        std::chrono::duration_cast<steady::duration>(
+            std::chrono::duration<double>(drain_s)));
+
+    step_result total;
+    for (auto &w : workers) {
+      total.merge(w->collect());
+    }
+
+    const latency_histogram &h = total.latencies;
+    uint64_t lost = total.sent - total.received + total.send_errors;
+    std::cout << std::fixed << std::setprecision(0) << std::setw(10) << rate
+              << std::setw(10) << total.sent / duration_s << std::setw(10)
+              << total.received / duration_s << std::setprecision(1)
+              << std::setw(10) << h.percentile(50) / 1e3 << std::setw(10)
+              << h.percentile(90) / 1e3 << std::setw(10)
+              << h.percentile(99) / 1e3 << std::setw(10)
+              << h.percentile(99.9) / 1e3 << std::setw(10) << h.max() / 1e3
+              << std::setw(10) << lost << std::setw(12)
+              << total.max_send_lag_ns / 1e3 << std::endl;
+
+    if (!histogram_dir.empty()) {
+      std::ofstream out(histogram_dir + "/loadgen_" +
+                        std::to_string(static_cast<long long>(rate)) +
+                        ".hgrm");
+      h.dump(out, 1000.0);
+    }
+
+    // Saturated once the server stops keeping up with the offered load or
+    // the tail blows through the latency objective.
+    if (saturation == 0 &&
+        (lost > 0 || h.percentile(99) > slo_us * 1e3)) {
+      saturation = rate;
+    }
+  }
+
+  if (saturation > 0) {
+    std::cout << "# saturated at " << saturation << " msg/s (p99 > " << slo_us
+              << "us or replies lost)" << std::endl;
+  } else {
+    std::cout << "# no saturation up to " << rates.back() << " msg/s"
+              << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,446 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Append-only binary journal of normalized order book updates.
+//
+// Layout of the journal file:
+//   [journal_header, padded to 4096 bytes][journal_record 0][record 1]...
+// Records are fixed size, so record i lives at a computable offset and the
+// file can be mapped and read without parsing. The header holds the
+// instrument table and the number of committed records.
+//
+// Next to the journal, <journal>.<slot>.idx holds, for each instrument slot,
+// the positions of that instrument's records in order:
+//   [journal_index_header, 64 bytes][uint64_t position]...
+//
+// Both are grown by doubling and written through shared mappings, so
+// appending is a memcpy; the kernel writes pages back in the background.
+
+static const int journal_depth = 20;
+static const uint32_t journal_max_instruments = 64;
+static const size_t journal_name_size = 32;
+
+struct journal_level {
+  double price;
+  double amount;
+};
+
+struct journal_record {
+  uint64_t sequence;    // position in the journal
+  uint64_t change_id;   // exchange's book version
+  int64_t exchange_ms;  // exchange timestamp
+  int64_t recv_wall_ns; // server receive time, system_clock
+  int64_t recv_mono_ns; // server receive time, steady_clock
+  uint32_t instrument;  // slot in the header's instrument table
+  uint16_t bid_count;
+  uint16_t ask_count;
+  uint64_t reserved[2];
+  journal_level bids[journal_depth];
+  journal_level asks[journal_depth];
+};
+static_assert(sizeof(journal_record) ==
+                  64 + 2 * journal_depth * sizeof(journal_level),
+              "journal_record layout is part of the file format");
+
+struct journal_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t depth;
+  uint32_t instrument_count;
+  uint64_t record_count; // records fully written; readers stop here
+  char instruments[journal_max_instruments][journal_name_size];
+};
+
+struct journal_index_header {
+  char magic[8];
+  uint64_t count;
+  uint64_t reserved[6];
+};
+
+static const size_t journal_header_size = 4096;
+static const char journal_magic[8] = {'M', 'D', 'J', 'R', 'N', 'L', '1', 0};
+static const char journal_index_magic[8] = {'M', 'D', 'J', 'I', 'D', 'X', '1', 0};
+
+// A file mapped MAP_SHARED in its entirety. Writable mappings can grow.
+class mapped_file {
+public:
+  mapped_file(const std::string &path, bool writable)
+      : m_writable(writable) {
+    m_fd = ::open(path.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (m_fd < 0) {
+      throw std::runtime_error("open " + path + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) {
+      ::close(m_fd);
+      throw std::runtime_error("stat " + path + ": " + std::strerror(errno));
+    }
+    if (st.st_size > 0) {
+      map(static_cast<size_t>(st.st_size));
+    }
+  }
+
+  ~mapped_file() {
+    if (m_data) {
+      if (m_writable) {
+        msync(m_data, m_size, MS_SYNC);
+      }
+      munmap(m_data, m_size);
+    }
+    ::close(m_fd);
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  // Makes at least `size` bytes available, doubling to amortize remaps
+  void reserve(size_t size) {
+    if (size <= m_size) {
+      return;
+    }
+    size_t grown = m_size ? m_size : 1 << 20;
+    while (grown < size) {
+      grown *= 2;
+    }
+    // Allocated rather than just truncated to size, so a full disk is an
+    // error here and not a SIGBUS on some later store into the mapping
+    int error = posix_fallocate(m_fd, 0, static_cast<off_t>(grown));
+    if (error != 0) {
+      throw std::runtime_error(std::string("posix_fallocate: ") +
+                               std::strerror(error));
+    }
+    if (m_data) {
+      munmap(m_data, m_size);
+      m_data = nullptr;
+    }
+    map(grown);
+  }
+
+  char *data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  void map(size_t size) {
+    void *p = mmap(nullptr, size, m_writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, m_fd, 0);
+    if (p == MAP_FAILED) {
+      throw std::runtime_error(std::string("mmap: ") + std::strerror(errno));
+    }
+    m_data = static_cast<char *>(p);
+    m_size = size;
+  }
+
+  int m_fd;
+  bool m_writable;
+  char *m_data = nullptr;
+  size_t m_size = 0;
+};
+
+// Records order book updates from the feed thread.
+//
+// append() normalizes the book into a journal_record and hands it to a
+// single-producer single-consumer ring; a writer thread copies records into
+// the mapped files. The feed thread never touches the files and never waits:
+// when the ring is full the update is dropped and counted.
+//
+// If the writer fails to grow a file (disk full, say), journaling stops for
+// good rather than take the feed down with it: `on_error` is told once, on
+// the writer thread, and every update from then on is dropped and counted.
+class market_journal {
+public:
+  static const size_t ring_capacity = 4096;
+  typedef std::function<void(const std::string &)> error_handler;
+
+  explicit market_journal(const std::string &path,
+                          error_handler on_error = nullptr)
+      : m_path(path), m_file(path, true), m_ring(new entry[ring_capacity]),
+        m_on_error(std::move(on_error)) {
+    if (m_file.size() == 0) {
+      m_file.reserve(journal_header_size + 1024 * sizeof(journal_record));
+      journal_header *h = header();
+      std::memcpy(h->magic, journal_magic, sizeof(journal_magic));
+      h->version = 1;
+      h->record_size = sizeof(journal_record);
+      h->depth = journal_depth;
+    } else if (std::memcmp(header()->magic, journal_magic,
+                           sizeof(journal_magic)) != 0 ||
+               header()->record_size != sizeof(journal_record)) {
+      throw std::runtime_error(path + " is not a compatible market journal");
+    }
+    for (uint32_t i = 0; i < header()->instrument_count; ++i) {
+      open_index(i);
+      // A crash between writing an index entry and committing its record
+      // leaves an entry for a record that does not exist
+      journal_index_header *ih =
+          reinterpret_cast<journal_index_header *>(m_indexes[i]->data());
+      const uint64_t *positions = reinterpret_cast<const uint64_t *>(
+          m_indexes[i]->data() + sizeof(journal_index_header));
+      while (ih->count > 0 && positions[ih->count - 1] >= header()->record_count) {
+        --ih->count;
+      }
+    }
+    m_writer = std::thread(&market_journal::write_loop, this);
+  }
+
+  ~market_journal() {
+    m_running.store(false, std::memory_order_release);
+    m_writer.join();
+    drain();
+  }
+
+  market_journal(const market_journal &) = delete;
+  market_journal &operator=(const market_journal &) = delete;
+
+  // `book` is the "result" of public/get_order_book. Only the feed thread
+  // may call this. Returns false if the update was dropped.
+  bool append(const std::string &instrument, const nlohmann::json &book,
+              int64_t recv_wall_ns, int64_t recv_mono_ns) {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (m_failed.load(std::memory_order_relaxed) ||
+        tail - m_head.load(std::memory_order_acquire) == ring_capacity) {
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    entry &e = m_ring[tail & (ring_capacity - 1)];
+    std::memset(&e, 0, sizeof(e));
+    std::strncpy(e.instrument, instrument.c_str(), journal_name_size - 1);
+    journal_record &r = e.record;
+    r.change_id = book.value("change_id", uint64_t(0));
+    r.exchange_ms = book.value("timestamp", int64_t(0));
+    r.recv_wall_ns = recv_wall_ns;
+    r.recv_mono_ns = recv_mono_ns;
+    r.bid_count = copy_levels(book, "bids", r.bids);
+    r.ask_count = copy_levels(book, "asks", r.asks);
+
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+  struct entry {
+    char instrument[journal_name_size];
+    journal_record record;
+  };
+
+  static uint16_t copy_levels(const nlohmann::json &book, const char *side,
+                              journal_level *levels) {
+    auto it = book.find(side);
+    if (it == book.end() || !it->is_array()) {
+      return 0;
+    }
+    uint16_t n = 0;
+    for (const auto &level : *it) {
+      if (n == journal_depth) {
+        break;
+      }
+      if (level.is_array() && level.size() >= 2) {
+        levels[n].price = level[0].get<double>();
+        levels[n].amount = level[1].get<double>();
+        ++n;
+      }
+    }
+    return n;
+  }
+
+  journal_header *header() {
+    return reinterpret_cast<journal_header *>(m_file.data());
+  }
+
+  void open_index(uint32_t slot) {
+    m_indexes.emplace_back(new mapped_file(
+        m_path + "." + std::to_string(slot) + ".idx", true));
+    mapped_file &index = *m_indexes.back();
+    if (index.size() == 0) {
+      index.reserve(sizeof(journal_index_header) + 4096 * sizeof(uint64_t));
+      std::memcpy(index.data(), journal_index_magic,
+                  sizeof(journal_index_magic));
+    }
+  }
+
+  // Slot for an instrument, adding it to the table on first sight.
+  // journal_max_instruments if the table is full.
+  uint32_t slot_of(const char *instrument) {
+    journal_header *h = header();
+    for (uint32_t i = 0; i < h->instrument_count; ++i) {
+      if (std::strncmp(h->instruments[i], instrument, journal_name_size) == 0) {
+        return i;
+      }
+    }
+    if (h->instrument_count == journal_max_instruments) {
+      return journal_max_instruments;
+    }
+    std::memcpy(h->instruments[h->instrument_count], instrument,
+                journal_name_size);
+    open_index(h->instrument_count);
+    return h->instrument_count++;
+  }
+
+  void write(entry &e) {
+    uint32_t slot = slot_of(e.instrument);
+    if (slot == journal_max_instruments) {
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    uint64_t position = header()->record_count;
+    m_file.reserve(journal_header_size +
+                   (position + 1) * sizeof(journal_record));
+    e.record.sequence = position;
+    e.record.instrument = slot;
+    std::memcpy(m_file.data() + journal_header_size +
+                    position * sizeof(journal_record),
+                &e.record, sizeof(journal_record));
+
+    mapped_file &index = *m_indexes[slot];
+    uint64_t count =
+        reinterpret_cast<journal_index_header *>(index.data())->count;
+    index.reserve(sizeof(journal_index_header) + (count + 1) * sizeof(uint64_t));
+    journal_index_header *ih =
+        reinterpret_cast<journal_index_header *>(index.data());
+    reinterpret_cast<uint64_t *>(index.data() + sizeof(journal_index_header))
+        [count] = position;
+    __atomic_store_n(&ih->count, count + 1, __ATOMIC_RELEASE);
+
+    // Publish last so a concurrent reader never sees a partial record
+    __atomic_store_n(&header()->record_count, position + 1, __ATOMIC_RELEASE);
+  }
+
+  // Writes out what append() has queued. After a failed write the entries
+  // are only counted as dropped.
+  size_t drain() {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t tail = m_tail.load(std::memory_order_acquire);
+    for (size_t i = head; i != tail; ++i) {
+      if (m_failed.load(std::memory_order_relaxed)) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        try {
+          write(m_ring[i & (ring_capacity - 1)]);
+        } catch (const std::exception &e) {
+          // A record is committed last, so the files still hold only whole
+          // records
+          m_failed.store(true, std::memory_order_relaxed);
+          m_dropped.fetch_add(1, std::memory_order_relaxed);
+          if (m_on_error) {
+            m_on_error("market journal " + m_path + " stopped: " + e.what());
+          }
+        }
+      }
+      m_head.store(i + 1, std::memory_order_release);
+    }
+    return tail - head;
+  }
+
+  void write_loop() {
+    while (m_running.load(std::memory_order_acquire)) {
+      if (drain() == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  }
+
+  std::string m_path;
+  mapped_file m_file;
+  std::vector<std::unique_ptr<mapped_file>> m_indexes;
+  std::unique_ptr<entry[]> m_ring;
+  alignas(64) std::atomic<size_t> m_head{0};
+  alignas(64) std::atomic<size_t> m_tail{0};
+  std::atomic<uint64_t> m_dropped{0};
+  error_handler m_on_error;
+  std::atomic<bool> m_failed{false};
+  std::atomic<bool> m_running{true};
+  std::thread m_writer;
+};
+
+// Read-only view of a journal, for replay and offline analysis. Sees the
+// records committed when it was opened.
+class journal_reader {
+public:
+  explicit journal_reader(const std::string &path) : m_file(path, false) {
+    if (m_file.size() < journal_header_size ||
+        std::memcmp(header()->magic, journal_magic, sizeof(journal_magic)) !=
+            0 ||
+        header()->record_size != sizeof(journal_record)) {
+      throw std::runtime_error(path + " is not a compatible market journal");
+    }
+    m_count = __atomic_load_n(&header()->record_count, __ATOMIC_ACQUIRE);
+    m_instruments = header()->instrument_count;
+    for (uint32_t i = 0; i < m_instruments; ++i) {
+      m_indexes.emplace_back(
+          new mapped_file(path + "." + std::to_string(i) + ".idx", false));
+    }
+  }
+
+  uint64_t size() const { return m_count; }
+
+  const journal_record &operator[](uint64_t position) const {
+    return *reinterpret_cast<const journal_record *>(
+        m_file.data() + journal_header_size +
+        position * sizeof(journal_record));
+  }
+
+  uint32_t instrument_count() const { return m_instruments; }
+
+  std::string instrument_name(uint32_t slot) const {
+    const char *name = header()->instruments[slot];
+    return std::string(name, strnlen(name, journal_name_size));
+  }
+
+  // Slot of an instrument, or instrument_count() if it was never recorded
+  uint32_t find_instrument(const std::string &name) const {
+    for (uint32_t i = 0; i < instrument_count(); ++i) {
+      if (instrument_name(i) == name) {
+        return i;
+      }
+    }
+    return instrument_count();
+  }
+
+  // Journal positions of one instrument's records, oldest first. Entries
+  // past size() belong to records committed after this reader was opened.
+  const uint64_t *index(uint32_t slot, uint64_t &count) const {
+    const mapped_file &f = *m_indexes[slot];
+    count = __atomic_load_n(
+        &reinterpret_cast<const journal_index_header *>(f.data())->count,
+        __ATOMIC_ACQUIRE);
+    count = std::min<uint64_t>(
+        count, (f.size() - sizeof(journal_index_header)) / sizeof(uint64_t));
+    const uint64_t *positions = reinterpret_cast<const uint64_t *>(
+        f.data() + sizeof(journal_index_header));
+    while (count > 0 && positions[count - 1] >= m_count) {
+      --count;
+    }
+    return positions;
+  }
+
+private:
+  const journal_header *header() const {
+    return reinterpret_cast<const journal_header *>(m_file.data());
+  }
+
+  mapped_file m_file;
+  uint64_t m_count;
+  uint32_t m_instruments;
+  std::vector<std::unique_ptr<mapped_file>> m_indexes;
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "market_journal.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// One recorded order book update
+struct replay_update {
+  std::string instrument;
+  nlohmann::json book; // shaped like the "result" of public/get_order_book
+  int64_t recorded_ns; // when it was recorded; only differences are used
+};
+
+// Plays back recorded market data in place of polling the exchange.
+//
+// The source is either a market journal (see market_journal.hpp) or a JSONL
+// capture with one book per line: a public/get_order_book response, just its
+// "result", or one of our own orderbook_update messages (the book under
+// "data", as in benchmark_data/orderbook_updates.jsonl). A line may carry
+// "instrument" and "recv_wall_ns" beside the book; otherwise the book's
+// instrument_name and timestamp are used.
+//
+// Updates come out in recorded order. With speed > 0, next() waits until
+// each update is due, keeping the recorded gaps scaled by 1/speed; with
+// speed 0 it returns them as fast as they are asked for.
+class market_replay {
+public:
+  market_replay(const std::string &path, double speed) : m_speed(speed) {
+    char magic[sizeof(journal_magic)] = {};
+    {
+      std::ifstream probe(path, std::ios::binary);
+      if (!probe) {
+        throw std::runtime_error("cannot open replay source " + path);
+      }
+      probe.read(magic, sizeof(magic));
+    }
+    if (std::memcmp(magic, journal_magic, sizeof(journal_magic)) == 0) {
+      m_journal.reset(new journal_reader(path));
+    } else {
+      m_capture.open(path);
+    }
+  }
+
+  // Fills in the next update once it is due. Returns false at the end of
+  // the source.
+  bool next(replay_update &update) {
+    if (!(m_journal ? read_journal(update) : read_capture(update))) {
+      return false;
+    }
+    if (m_position++ == 0) {
+      m_first_recorded_ns = update.recorded_ns;
+      m_start = std::chrono::steady_clock::now();
+    } else if (m_speed > 0) {
+      auto offset = std::chrono::nanoseconds(static_cast<int64_t>(
+          (update.recorded_ns - m_first_recorded_ns) / m_speed));
+      std::this_thread::sleep_until(m_start + offset);
+    }
+    return true;
+  }
+
+  // Updates returned so far
+  uint64_t position() const { return m_position; }
+
+private:
+  bool read_journal(replay_update &update) {
+    if (m_position == m_journal->size()) {
+      return false;
+    }
+    const journal_record &r = (*m_journal)[m_position];
+    update.instrument = m_journal->instrument_name(r.instrument);
+    update.recorded_ns = r.recv_wall_ns;
+    update.book = {{"instrument_name", update.instrument},
+                   {"timestamp", r.exchange_ms},
+                   {"change_id", r.change_id},
+                   {"bids", levels(r.bids, r.bid_count)},
+                   {"asks", levels(r.asks, r.ask_count)}};
+    return true;
+  }
+
+  static nlohmann::json levels(const journal_level *side, uint16_t count) {
+    nlohmann::json out = nlohmann::json::array();
+    for (uint16_t i = 0; i < count; ++i) {
+      out.push_back({side[i].price, side[i].amount});
+    }
+    return out;
+  }
+
+  bool read_capture(replay_update &update) {
+    while (std::getline(m_capture, m_line)) {
+      if (m_line.empty() || m_line[0] != '{') {
+        continue;
+      }
+      nlohmann::json line = nlohmann::json::parse(m_line);
+      auto result = line.find("result");
+      if (result == line.end()) {
+        result = line.find("data");
+      }
+      const nlohmann::json &book = result != line.end() ? *result : line;
+      update.instrument = line.value(
+          "instrument", book.value("instrument_name", std::string()));
+      update.recorded_ns = line.value(
+          "recv_wall_ns", book.value("timestamp", int64_t(0)) * 1000000);
+      update.book =
+          result != line.end() ? std::move(*result) : std::move(line);
+      return true;
+    }
+    return false;
+  }
+
+  double m_speed;
+  std::unique_ptr<journal_reader> m_journal;
+  std::ifstream m_capture;
+  std::string m_line;
+  uint64_t m_position = 0;
+  int64_t m_first_recorded_ns = 0;
+  std::chrono::steady_clock::time_point m_start;
+};
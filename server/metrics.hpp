@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Counters, gauges and latency histograms for the server, rendered in the
+// Prometheus text exposition format.
+//
+// Counters and histograms are sharded per thread. Each thread lazily gets its
+// own shard and is the only writer to it, so recording is a relaxed load and
+// store on memory no other thread writes: no lock, no contended cache line.
+// A scrape sums the shards. Shards live as long as the registry, so counts
+// from threads that have exited are kept. Gauges are point-in-time values and
+// are plain shared atomics.
+class metrics {
+public:
+  enum counter {
+    messages_received,
+    bytes_received,
+    messages_sent,
+    bytes_sent,
+    journal_dropped,
+    orders_rejected,
+    orders_timed_out,
+    requests_shed,
+    counter_count
+  };
+
+  enum gauge {
+    connections,
+    send_queue_bytes,
+    send_queue_max_bytes,
+    orders_in_flight,
+    gauge_count
+  };
+
+  enum histogram {
+    poll_rtt,         // orderbook REST request to response
+    orderbook_parse,  // parsing the exchange's orderbook response
+    broadcast_fanout, // framing and queueing one update on every connection
+    order_rtt,        // order/edit/cancel on the wire to exchange response
+    order_queue_wait, // order/edit/cancel submitted to on the wire
+    mass_cancel,      // kill switch or disconnect to cancel confirmed
+    histogram_count
+  };
+
+  void add(counter c, uint64_t n = 1) { bump(local().counters[c], n); }
+
+  void set(gauge g, int64_t value) {
+    m_gauges[g].store(value, std::memory_order_relaxed);
+  }
+
+  void observe(histogram h, std::chrono::nanoseconds elapsed) {
+    uint64_t ns = elapsed.count() < 0 ? 0 : elapsed.count();
+    shard::buckets &b = local().histograms[h];
+    size_t i = std::lower_bound(bounds_ns().begin(), bounds_ns().end(), ns) -
+               bounds_ns().begin();
+    bump(b.counts[i], 1);
+    bump(b.sum_ns, ns);
+  }
+
+  std::string prometheus() const {
+    std::array<uint64_t, counter_count> counters{};
+    std::array<std::array<uint64_t, bucket_count + 1>, histogram_count>
+        counts{};
+    std::array<uint64_t, histogram_count> sums{};
+    {
+      std::lock_guard<std::mutex> lock(m_shards_mutex);
+      for (const auto &s : m_shards) {
+        for (int c = 0; c < counter_count; ++c) {
+          counters[c] += s->counters[c].load(std::memory_order_relaxed);
+        }
+        for (int h = 0; h < histogram_count; ++h) {
+          for (size_t i = 0; i <= bucket_count; ++i) {
+            counts[h][i] +=
+                s->histograms[h].counts[i].load(std::memory_order_relaxed);
+          }
+          sums[h] += s->histograms[h].sum_ns.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    static const char *const counter_names[counter_count][2] = {
+        {"messages_received_total", "WebSocket messages received"},
+        {"bytes_received_total", "WebSocket payload bytes received"},
+        {"messages_sent_total", "WebSocket messages queued for sending"},
+        {"bytes_sent_total", "WebSocket payload bytes queued for sending"},
+        {"journal_dropped_total",
+         "Order book updates not journaled: the ring was full or the journal "
+         "stopped"},
+        {"orders_rejected_total",
+         "Orders rejected by pre-trade checks without reaching the exchange"},
+        {"orders_timed_out_total",
+         "Orders, edits and cancels the exchange did not answer in time"},
+        {"requests_shed_total",
+         "Exchange requests skipped or refused for lack of rate limit "
+         "credits"}};
+    static const char *const gauge_names[gauge_count][2] = {
+        {"connections", "Open WebSocket connections"},
+        {"send_queue_bytes",
+         "Bytes buffered for sending across all connections at the last "
+         "broadcast"},
+        {"send_queue_max_bytes",
+         "Largest per-connection send buffer at the last broadcast"},
+        {"orders_in_flight",
+         "Orders, edits and cancels sent to the exchange and not yet answered"}};
+    static const char *const histogram_names[histogram_count][2] = {
+        {"poll_rtt_seconds", "Orderbook REST poll round trip"},
+        {"orderbook_parse_seconds", "Parsing an orderbook response"},
+        {"broadcast_fanout_seconds",
+         "Queueing one update on every connection"},
+        {"order_rtt_seconds", "Order, edit and cancel round trip to exchange"},
+        {"order_queue_wait_seconds",
+         "Order, edit and cancel wait in the gateway before being sent"},
+        {"mass_cancel_seconds",
+         "Kill switch or cancel-on-disconnect to the exchange confirming the "
+         "cancel"}};
+
+    std::ostringstream out;
+    for (int c = 0; c < counter_count; ++c) {
+      header(out, counter_names[c], "counter");
+      out << prefix << counter_names[c][0] << " " << counters[c] << "\n";
+    }
+    for (int g = 0; g < gauge_count; ++g) {
+      header(out, gauge_names[g], "gauge");
+      out << prefix << gauge_names[g][0] << " "
+          << m_gauges[g].load(std::memory_order_relaxed) << "\n";
+    }
+    for (int h = 0; h < histogram_count; ++h) {
+      header(out, histogram_names[h], "histogram");
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i <= bucket_count; ++i) {
+        cumulative += counts[h][i];
+        out << prefix << histogram_names[h][0] << "_bucket{le=\"";
+        if (i < bucket_count) {
+          out << bounds_ns()[i] / 1e9;
+        } else {
+          out << "+Inf";
+        }
+        out << "\"} " << cumulative << "\n";
+      }
+      out << prefix << histogram_names[h][0] << "_sum " << sums[h] / 1e9
+          << "\n"
+          << prefix << histogram_names[h][0] << "_count " << cumulative
+          << "\n";
+    }
+    return out.str();
+  }
+
+private:
+  static constexpr const char *prefix = "trading_server_";
+  static const size_t bucket_count = 19;
+
+  // Upper bounds from 5us to 5s, roughly 1-2.5-5 per decade
+  static const std::array<uint64_t, bucket_count> &bounds_ns() {
+    static const std::array<uint64_t, bucket_count> bounds = {
+        5000,      10000,     25000,      50000,      100000,
+        250000,    500000,    1000000,    2500000,    5000000,
+        10000000,  25000000,  50000000,   100000000,  250000000,
+        500000000, 1000000000, 2500000000, 5000000000};
+    return bounds;
+  }
+
+  struct shard {
+    struct buckets {
+      std::atomic<uint64_t> counts[bucket_count + 1] = {};
+      std::atomic<uint64_t> sum_ns{0};
+    };
+    std::atomic<uint64_t> counters[counter_count] = {};
+    buckets histograms[histogram_count];
+  };
+
+  // Only the owning thread writes a shard, so no read-modify-write is needed
+  static void bump(std::atomic<uint64_t> &value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  }
+
+  // Caches one registry per thread; the server only ever has one.
+  shard &local() {
+    thread_local const metrics *owner = nullptr;
+    thread_local shard *cached = nullptr;
+    if (owner != this) {
+      std::lock_guard<std::mutex> lock(m_shards_mutex);
+      m_shards.emplace_back(new shard);
+      cached = m_shards.back().get();
+      owner = this;
+    }
+    return *cached;
+  }
+
+  static void header(std::ostream &out, const char *const (&name)[2],
+                     const char *type) {
+    out << "# HELP " << prefix << name[0] << " " << name[1] << "\n"
+        << "# TYPE " << prefix << name[0] << " " << type << "\n";
+  }
+
+  mutable std::mutex m_shards_mutex;
+  std::vector<std::unique_ptr<shard>> m_shards;
+  std::atomic<int64_t> m_gauges[gauge_count] = {};
+};
@@ -0,0 +1,566 @@
+// Local stand-in for the Deribit test exchange.
+//
+// Speaks the subset of the v2 REST/JSON-RPC API that server.cpp uses so the
+// server, and the benchmarks that drive it, can run without internet access
+// and without exchange RTT dominating the numbers. Point the server at it
+// with EXCHANGE_URL=http://localhost:8080.
+//
+// Every response is delayed by --latency-us plus a uniform random amount of
+// up to --jitter-us to model the exchange's own processing time.
+
+#include "httplib.h"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+
+struct instrument {
+  std::string name;
+  std::string currency;
+  std::string kind;
+  double tick_size;
+  double contract_size;
+  double mid;
+};
+
+struct order {
+  std::string id;
+  std::string instrument_name;
+  std::string direction;
+  std::string type;
+  std::string state;
+  std::string label;
+  double amount;
+  double filled;
+  double price;
+  double average_price;
+  long long created;
+  long long updated;
+};
+
+struct position {
+  double size = 0;
+  double average_price = 0;
+  double realized = 0;
+};
+
+long long now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+long long now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+class rpc_error : public std::runtime_error {
+public:
+  rpc_error(int code, const std::string &message)
+      : std::runtime_error(message), m_code(code) {}
+  int code() const { return m_code; }
+
+private:
+  int m_code;
+};
+
+} // namespace
+
+class mock_exchange {
+public:
+  mock_exchange(std::chrono::microseconds latency,
+                std::chrono::microseconds jitter)
+      : m_latency(latency), m_jitter(jitter), m_rng(42) {
+    m_instruments = {
+        {"BTC-PERPETUAL", "BTC", "future", 0.5, 10, 68000},
+        {"BTC-27DEC24", "BTC", "future", 2.5, 10, 68900},
+        {"BTC-28MAR25", "BTC", "future", 2.5, 10, 70100},
+        {"BTC-27DEC24-70000-C", "BTC", "option", 0.0005, 1, 0.052},
+        {"ETH-PERPETUAL", "ETH", "future", 0.05, 1, 2450},
+        {"ETH-27DEC24", "ETH", "future", 0.25, 1, 2480},
+        {"ETH-27DEC24-2500-P", "ETH", "option", 0.0005, 1, 0.071},
+    };
+  }
+
+  void route(httplib::Server &http) {
+    const char *pattern = R"(/api/v2/(public|private)/(\w+))";
+    http.Get(pattern, [this](const httplib::Request &req,
+                             httplib::Response &res) {
+      json params = json::object();
+      for (const auto &p : req.params) {
+        params[p.first] = p.second;
+      }
+      handle(req, res, req.matches[2], params, 0);
+    });
+    http.Post(pattern, [this](const httplib::Request &req,
+                              httplib::Response &res) {
+      json body = json::parse(req.body, nullptr, false);
+      if (body.is_discarded() || !body.is_object()) {
+        reply_error(res, 0, 11050, "bad_request");
+        return;
+      }
+      // The body's method wins over the path, as on the real exchange
+      std::string method = req.matches[2];
+      if (body.contains("method")) {
+        std::string full = body["method"];
+        method = full.substr(full.find('/') + 1);
+      }
+      handle(req, res, method, body.value("params", json::object()),
+             body.value("id", 0));
+    });
+  }
+
+private:
+  void handle(const httplib::Request &req, httplib::Response &res,
+              const std::string &method, const json &params, long long id) {
+    long long us_in = now_us();
+    inject_latency();
+
+    try {
+      json result;
+      if (method == "auth") {
+        result = auth();
+      } else if (method == "get_instruments") {
+        result = get_instruments(params);
+      } else if (method == "get_order_book") {
+        result = get_order_book(params);
+      } else {
+        authorize(req);
+        if (method == "buy" || method == "sell") {
+          result = place(method, params);
+        } else if (method == "edit") {
+          result = edit(params);
+        } else if (method == "cancel") {
+          result = cancel(params);
+        } else if (method == "cancel_all_by_instrument") {
+          result = cancel_all_by_instrument(params);
+        } else if (method == "cancel_by_label") {
+          result = cancel_by_label(params);
+        } else if (method == "cancel_all") {
+          result = cancel_all();
+        } else if (method == "get_positions") {
+          result = get_positions(params);
+        } else if (method == "get_open_orders_by_currency") {
+          result = get_open_orders(params);
+        } else {
+          throw rpc_error(-32601, "Method not found");
+        }
+      }
+
+      long long us_out = now_us();
+      json body = {{"jsonrpc", "2.0"},     {"id", id},
+                   {"result", result},     {"usIn", us_in},
+                   {"usOut", us_out},      {"usDiff", us_out - us_in},
+                   {"testnet", true}};
+      res.set_content(body.dump(), "application/json");
+    } catch (const rpc_error &e) {
+      reply_error(res, id, e.code(), e.what());
+    } catch (const std::exception &e) {
+      reply_error(res, id, 11050, std::string("bad_request: ") + e.what());
+    }
+  }
+
+  void reply_error(httplib::Response &res, long long id, int code,
+                   const std::string &message) {
+    json body = {{"jsonrpc", "2.0"},
+                 {"id", id},
+                 {"error", {{"code", code}, {"message", message}}},
+                 {"testnet", true}};
+    res.status = 400;
+    res.set_content(body.dump(), "application/json");
+  }
+
+  void inject_latency() {
+    if (m_latency.count() == 0 && m_jitter.count() == 0) {
+      return;
+    }
+    thread_local std::mt19937 rng(std::random_device{}());
+    auto delay = m_latency;
+    if (m_jitter.count() > 0) {
+      std::uniform_int_distribution<long long> dist(0, m_jitter.count());
+      delay += std::chrono::microseconds(dist(rng));
+    }
+    std::this_thread::sleep_for(delay);
+  }
+
+  void authorize(const httplib::Request &req) {
+    const std::string prefix = "Bearer ";
+    std::string header = req.get_header_value("Authorization");
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (header.compare(0, prefix.size(), prefix) != 0 ||
+        m_tokens.count(header.substr(prefix.size())) == 0) {
+      throw rpc_error(13009, "unauthorized");
+    }
+  }
+
+  json auth() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string token = "mock-token-" + std::to_string(++m_token_seq);
+    m_tokens[token] = now_ms();
+    return {{"access_token", token},
+            {"expires_in", 900},
+            {"refresh_token", "mock-refresh-" + std::to_string(m_token_seq)},
+            {"scope", "session:mock trade:read_write"},
+            {"token_type", "bearer"}};
+  }
+
+  json get_instruments(const json &params) {
+    std::string currency = params.value("currency", "BTC");
+    std::string kind = params.value("kind", "future");
+
+    json result = json::array();
+    for (const auto &i : m_instruments) {
+      if ((currency != "any" && i.currency != currency) ||
+          (kind != "any" && i.kind != kind)) {
+        continue;
+      }
+      result.push_back(
+          {{"instrument_name", i.name},
+           {"kind", i.kind},
+           {"base_currency", i.currency},
+           {"quote_currency", i.kind == "option" ? i.currency : "USD"},
+           {"settlement_currency", i.currency},
+           {"tick_size", i.tick_size},
+           {"contract_size", i.contract_size},
+           {"min_trade_amount", i.kind == "future" ? i.contract_size : 0.1},
+           {"settlement_period",
+            i.name.find("PERPETUAL") != std::string::npos ? "perpetual"
+                                                           : "month"},
+           {"is_active", true}});
+    }
+    return result;
+  }
+
+  json get_order_book(const json &params) {
+    std::string name = params.at("instrument_name");
+    int depth = params.contains("depth") ? to_int(params["depth"]) : 5;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    instrument &i = find_instrument(name);
+
+    // Random walk of a few ticks per request
+    std::normal_distribution<double> step(0.0, 3.0);
+    i.mid = std::max(i.tick_size * 10, i.mid + step(m_rng) * i.tick_size);
+
+    std::uniform_real_distribution<double> size(1, 50);
+    double best_bid = round_to_tick(i.mid - i.tick_size, i.tick_size);
+    double best_ask = round_to_tick(i.mid + i.tick_size, i.tick_size);
+
+    json bids = json::array();
+    json asks = json::array();
+    for (int level = 0; level < depth; ++level) {
+      double amount = std::round(size(m_rng)) * i.contract_size;
+      bids.push_back({best_bid - level * i.tick_size, amount});
+      amount = std::round(size(m_rng)) * i.contract_size;
+      asks.push_back({best_ask + level * i.tick_size, amount});
+    }
+
+    return {{"timestamp", now_ms()},
+            {"instrument_name", name},
+            {"change_id", ++m_change_id},
+            {"state", "open"},
+            {"bids", bids},
+            {"asks", asks},
+            {"best_bid_price", best_bid},
+            {"best_bid_amount", bids[0][1]},
+            {"best_ask_price", best_ask},
+            {"best_ask_amount", asks[0][1]},
+            {"mark_price", i.mid},
+            {"index_price", i.mid},
+            {"last_price", i.mid}};
+  }
+
+  json place(const std::string &direction, const json &params) {
+    std::string name = params.at("instrument_name");
+    double amount = to_double(params.at("amount"));
+    std::string type = params.value("type", "limit");
+    if (amount <= 0) {
+      throw rpc_error(10001, "invalid amount");
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    instrument &i = find_instrument(name);
+
+    order o;
+    o.id = "mock-" + std::to_string(++m_order_seq);
+    o.instrument_name = name;
+    o.direction = direction;
+    o.type = type;
+    o.label = params.value("label", "");
+    o.amount = amount;
+    o.filled = 0;
+    o.average_price = 0;
+    o.created = o.updated = now_ms();
+
+    double touch = direction == "buy" ? i.mid + i.tick_size
+                                      : i.mid - i.tick_size;
+    if (type == "market") {
+      o.price = touch;
+    } else if (params.contains("price")) {
+      o.price = to_double(params["price"]);
+    } else {
+      throw rpc_error(10001, "price required for limit order");
+    }
+
+    // Marketable orders fill in full at the touch, the rest rest
+    bool crosses = direction == "buy" ? o.price >= touch : o.price <= touch;
+    json trades = json::array();
+    if (type == "market" || crosses) {
+      fill(o, touch);
+      trades.push_back({{"trade_id", std::to_string(++m_trade_seq)},
+                        {"order_id", o.id},
+                        {"instrument_name", name},
+                        {"direction", direction},
+                        {"amount", o.amount},
+                        {"price", touch},
+                        {"timestamp", o.updated}});
+    } else {
+      o.state = "open";
+    }
+
+    m_orders[o.id] = o;
+    return {{"order", to_json(o)}, {"trades", trades}};
+  }
+
+  json edit(const json &params) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    order &o = find_open_order(params.at("order_id"));
+    o.amount = to_double(params.at("amount"));
+    if (params.contains("price")) {
+      o.price = to_double(params["price"]);
+    }
+    o.updated = now_ms();
+    return {{"order", to_json(o)}, {"trades", json::array()}};
+  }
+
+  json cancel(const json &params) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    order &o = find_open_order(params.at("order_id"));
+    o.state = "cancelled";
+    o.updated = now_ms();
+    return to_json(o);
+  }
+
+  // Returns the number of orders cancelled
+  json cancel_all_by_instrument(const json &params) {
+    std::string instrument = params.at("instrument_name");
+    std::string type = params.value("type", "all");
+    return cancel_where([&](const order &o) {
+      return o.instrument_name == instrument &&
+             (type == "all" || o.type == type);
+    });
+  }
+
+  json cancel_by_label(const json &params) {
+    std::string label = params.at("label");
+    return cancel_where([&](const order &o) { return o.label == label; });
+  }
+
+  json cancel_all() {
+    return cancel_where([](const order &) { return true; });
+  }
+
+  // Cancels every open order `match` accepts and returns how many
+  template <typename predicate> json cancel_where(predicate match) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int cancelled = 0;
+    for (auto &it : m_orders) {
+      order &o = it.second;
+      if (o.state == "open" && match(o)) {
+        o.state = "cancelled";
+        o.updated = now_ms();
+        ++cancelled;
+      }
+    }
+    return cancelled;
+  }
+
+  json get_positions(const json &params) {
+    std::string currency = params.value("currency", "BTC");
+    std::string kind = params.value("kind", "any");
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    json result = json::array();
+    for (const auto &i : m_instruments) {
+      auto it = m_positions.find(i.name);
+      if (it == m_positions.end() || i.currency != currency ||
+          (kind != "any" && i.kind != kind)) {
+        continue;
+      }
+      const position &p = it->second;
+      double floating = (i.mid - p.average_price) * p.size;
+      result.push_back({{"instrument_name", i.name},
+                        {"kind", i.kind},
+                        {"size", p.size},
+                        {"direction", p.size > 0   ? "buy"
+                                      : p.size < 0 ? "sell"
+                                                   : "zero"},
+                        {"average_price", p.average_price},
+                        {"mark_price", i.mid},
+                        {"floating_profit_loss", floating},
+                        {"realized_profit_loss", p.realized},
+                        {"total_profit_loss", floating + p.realized}});
+    }
+    return result;
+  }
+
+  json get_open_orders(const json &params) {
+    std::string currency = params.value("currency", "BTC");
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    json result = json::array();
+    for (const auto &it : m_orders) {
+      const order &o = it.second;
+      if (o.state == "open" &&
+          o.instrument_name.compare(0, currency.size(), currency) == 0) {
+        result.push_back(to_json(o));
+      }
+    }
+    return result;
+  }
+
+  // Caller holds m_mutex
+  void fill(order &o, double price) {
+    o.filled = o.amount;
+    o.average_price = price;
+    o.state = "filled";
+    o.updated = now_ms();
+
+    position &p = m_positions[o.instrument_name];
+    double signed_amount = o.direction == "buy" ? o.amount : -o.amount;
+    double size = p.size + signed_amount;
+    if (p.size == 0 || (p.size > 0) == (signed_amount > 0)) {
+      p.average_price =
+          (p.average_price * p.size + price * signed_amount) / size;
+    } else {
+      double closed = std::min(std::abs(p.size), std::abs(signed_amount));
+      p.realized += (price - p.average_price) * closed * (p.size > 0 ? 1 : -1);
+      if (size != 0 && (size > 0) != (p.size > 0)) {
+        p.average_price = price;
+      }
+    }
+    p.size = size;
+  }
+
+  // Caller holds m_mutex
+  instrument &find_instrument(const std::string &name) {
+    for (auto &i : m_instruments) {
+      if (i.name == name) {
+        return i;
+      }
+    }
+    throw rpc_error(10020, "invalid instrument_name: " + name);
+  }
+
+  // Caller holds m_mutex
+  order &find_open_order(const std::string &id) {
+    auto it = m_orders.find(id);
+    if (it == m_orders.end() || it->second.state != "open") {
+      throw rpc_error(10004, "order_not_found");
+    }
+    return it->second;
+  }
+
+  static json to_json(const order &o) {
+    return {{"order_id", o.id},
+            {"instrument_name", o.instrument_name},
+            {"direction", o.direction},
+            {"order_type", o.type},
+            {"order_state", o.state},
+            {"label", o.label},
+            {"amount", o.amount},
+            {"filled_amount", o.filled},
+            {"price", o.price},
+            {"average_price", o.average_price},
+            {"time_in_force", "good_til_cancelled"},
+            {"post_only", false},
+            {"reduce_only", false},
+            {"creation_timestamp", o.created},
+            {"last_update_timestamp", o.updated}};
+  }
+
+  static double round_to_tick(double price, double tick) {
+    return std::round(price / tick) * tick;
+  }
+
+  // Query string parameters arrive as strings, JSON-RPC ones as numbers
+  static double to_double(const json &v) {
+    return v.is_string() ? std::stod(v.get<std::string>()) : v.get<double>();
+  }
+
+  static int to_int(const json &v) {
+    return v.is_string() ? std::stoi(v.get<std::string>()) : v.get<int>();
+  }
+
+  const std::chrono::microseconds m_latency;
+  const std::chrono::microseconds m_jitter;
+
+  std::mutex m_mutex;
+  std::mt19937 m_rng;
+  std::vector<instrument> m_instruments;
+  std::map<std::string, order> m_orders;
+  std::map<std::string, position> m_positions;
+  std::map<std::string, long long> m_tokens;
+  long long m_token_seq = 0;
+  long long m_order_seq = 0;
+  long long m_trade_seq = 0;
+  long long m_change_id = 0;
+};
+
+int main(int argc, char **argv) {
+  // Loopback only unless asked: the mock accepts any order from anyone
+  std::string host = "127.0.0.1";
+  int port = 8080;
+  long long latency_us = 0;
+  long long jitter_us = 0;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--host") {
+      host = argv[i + 1];
+    } else if (flag == "--port") {
+      port = std::atoi(argv[i + 1]);
+    } else if (flag == "--latency-us") {
+      latency_us = std::atoll(argv[i + 1]);
+    } else if (flag == "--jitter-us") {
+      jitter_us = std::atoll(argv[i + 1]);
+    } else {
+      std::cerr << "usage: " << argv[0]
+                << " [--host ADDR] [--port N] [--latency-us N]"
+                   " [--jitter-us N]\n";
+      return 1;
+    }
+  }
+
+  mock_exchange exchange{std::chrono::microseconds(latency_us),
+                         std::chrono::microseconds(jitter_us)};
+  httplib::Server http;
+  // Without this Nagle and delayed acks add ~40ms to keep-alive responses
+  http.set_tcp_nodelay(true);
+  // Each keep-alive connection holds a pool thread between requests. The
+  // server's order gateway keeps one per worker, on top of its pollers.
+  http.new_task_queue = [] { return new httplib::ThreadPool(64); };
+  exchange.route(http);
+
+  std::cout << "Mock exchange listening on http://" << host << ":" << port
+            << " (latency " << latency_us << "us, jitter " << jitter_us
+            << "us)" << std::endl;
+  if (!http.listen(host, port)) {
+    std::cerr << "Failed to listen on " << host << ":" << port << std::endl;
+    return 1;
+  }
+  return 0;
+}
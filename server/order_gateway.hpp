@@ -0,0 +1,328 @@
+#pragma once
+
+#include "httplib.h"
+#include "request_scheduler.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// How an exchange request ended
+struct exchange_reply {
+  int status = 0;          // HTTP status; 0 if the request failed outright
+  std::string body;        // empty unless there was a response
+  bool timed_out = false;  // no reply within the gateway's timeout
+  bool sent = true;        // false if it never left the gateway
+  bool withdrawn = false;  // taken back unsent by order_gateway::withdraw
+  // On the wire to reply; zero unless a reply came back in time
+  std::chrono::steady_clock::duration rtt{};
+  // Submitted to on the wire, waiting for a worker and for rate limit
+  // credits; zero unless sent
+  std::chrono::steady_clock::duration queued{};
+};
+
+// Sends order requests to the exchange without making the caller wait for
+// the reply.
+//
+// submit() queues a JSON-RPC request and returns. A pool of workers, each
+// with its own keep-alive connection, sends queued requests as soon as one
+// is free, so a client that sends several orders back to back has them all
+// on the wire at once instead of one round trip after another. Each request
+// is entered in an in-flight table under its JSON-RPC id and is completed
+// exactly once, by whichever comes first: the exchange's reply, on the
+// worker that sent it, or its deadline, on the reaper thread. Replies are
+// therefore delivered in completion order, not submission order. A reply
+// that arrives after its deadline is dropped.
+//
+// A worker takes credits from the scheduler before it sends and waits for
+// them if it must. A request that can't have them before its deadline, or
+// whose deadline passes while it is queued, is completed with sent cleared
+// and never reaches the exchange. Only requests still in time are charged,
+// so a backlog that times out in the queue doesn't use up the credits of
+// the requests behind it.
+//
+// Orders and edits that have not been sent can be withdrawn, for instance
+// ahead of a mass cancel that should not be followed by the orders it was
+// meant to stop.
+//
+// Urgent requests (mass cancels) have a queue of their own that every worker
+// serves first, plus one reserved worker that serves nothing else, so there
+// is a connection free for them even when all the others are busy. They are
+// charged for credits but never wait for them.
+//
+// Handlers run on gateway threads and must not throw. The reaper runs them
+// one after another, so they should not block either.
+class order_gateway {
+public:
+  typedef std::function<void(const exchange_reply &)> reply_handler;
+
+  order_gateway(std::string url, size_t workers,
+                std::chrono::milliseconds timeout,
+                request_scheduler &scheduler)
+      : m_url(std::move(url)), m_timeout(timeout), m_scheduler(scheduler) {
+    for (size_t i = 0; i < workers; ++i) {
+      m_workers.emplace_back(&order_gateway::work, this, false);
+    }
+    m_workers.emplace_back(&order_gateway::work, this, true);
+    m_reaper = std::thread(&order_gateway::reap, this);
+  }
+
+  // Requests still queued are dropped unsent; handlers of requests already
+  // sent are not called.
+  ~order_gateway() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_work.notify_all();
+    m_urgent_work.notify_all();
+    m_expiry.notify_all();
+    for (auto &worker : m_workers) {
+      worker.join();
+    }
+    m_reaper.join();
+  }
+
+  order_gateway(const order_gateway &) = delete;
+  order_gateway &operator=(const order_gateway &) = delete;
+
+  // Queues a POST of `body` to `path`, charged to `cls`. `id` is the
+  // body's JSON-RPC id and must be unique among requests in flight. `owner`
+  // identifies whoever the request is for, to withdraw() by; it is never
+  // dereferenced. `done` is called once with the reply, or with timed_out
+  // set if none came within the timeout, counted from now.
+  void submit(uint64_t id, request_class cls, const void *owner,
+              std::string path, httplib::Headers headers, std::string body,
+              reply_handler done) {
+    enqueue(id, cls, owner, std::move(path), std::move(headers),
+            std::move(body), std::move(done), false);
+  }
+
+  // As submit(), ahead of everything not urgent. Urgent requests can't be
+  // withdrawn.
+  void submit_urgent(uint64_t id, request_class cls, std::string path,
+                     httplib::Headers headers, std::string body,
+                     reply_handler done) {
+    enqueue(id, cls, nullptr, std::move(path), std::move(headers),
+            std::move(body), std::move(done), true);
+  }
+
+  // Completes every order request of `owner`, or of any owner if it is
+  // null, that no worker has started sending, with sent cleared and
+  // withdrawn set. They never reach the exchange: a worker that later takes
+  // one from the queue, or holds one while it waits for credits, finds it
+  // answered and drops it. Cancels are left to go out. Returns how many
+  // were withdrawn.
+  size_t withdraw(const void *owner) {
+    std::vector<reply_handler> withdrawn;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (auto it = m_in_flight.begin(); it != m_in_flight.end();) {
+        const pending &p = it->second;
+        if (!p.sent && p.cls == request_class::order &&
+            (!owner || p.owner == owner)) {
+          withdrawn.push_back(std::move(it->second.done));
+          it = m_in_flight.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+    exchange_reply reply;
+    reply.sent = false;
+    reply.withdrawn = true;
+    for (reply_handler &done : withdrawn) {
+      done(reply);
+    }
+    return withdrawn.size();
+  }
+
+  // Requests submitted and not yet completed or timed out
+  size_t in_flight() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_in_flight.size();
+  }
+
+private:
+  struct job {
+    uint64_t id;
+    request_class cls;
+    bool urgent;
+    std::chrono::steady_clock::time_point deadline;
+    std::string path;
+    httplib::Headers headers;
+    std::string body;
+  };
+
+  struct pending {
+    reply_handler done;
+    request_class cls;
+    const void *owner;
+    std::chrono::steady_clock::time_point submitted;
+    std::chrono::steady_clock::time_point posted;
+    bool sent = false;
+  };
+
+  void enqueue(uint64_t id, request_class cls, const void *owner,
+               std::string path, httplib::Headers headers, std::string body,
+               reply_handler done, bool urgent) {
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = now + m_timeout;
+    bool first_deadline;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_in_flight[id] = pending{std::move(done), cls, owner, now};
+      first_deadline = m_deadlines.empty();
+      // Every request has the same timeout, so deadlines arrive in order
+      m_deadlines.emplace_back(deadline, id);
+      (urgent ? m_urgent : m_queue)
+          .push_back(job{id, cls, urgent, deadline, std::move(path),
+                         std::move(headers), std::move(body)});
+    }
+    m_work.notify_one();
+    if (urgent) {
+      m_urgent_work.notify_one();
+    }
+    if (first_deadline) {
+      m_expiry.notify_one();
+    }
+  }
+
+  // A reserved worker serves only the urgent queue
+  void work(bool reserved) {
+    httplib::Client cli(m_url);
+    cli.set_keep_alive(true);
+    // Headers and body go out as separate writes; on a reused connection
+    // Nagle would hold the body for the delayed ack of the headers
+    cli.set_tcp_nodelay(true);
+    cli.set_connection_timeout(m_timeout);
+    // The reaper answers at the deadline, saying the outcome is unknown.
+    // Give up on the reply a while after that rather than hold the worker
+    // for a reply nobody will see, but not before, or a slow reply would be
+    // reported as a failure to send.
+    cli.set_read_timeout(2 * m_timeout);
+    cli.set_write_timeout(2 * m_timeout);
+
+    for (;;) {
+      job j;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        (reserved ? m_urgent_work : m_work).wait(lock, [this, reserved] {
+          return m_stopping || !m_urgent.empty() ||
+                 (!reserved && !m_queue.empty());
+        });
+        if (m_stopping) {
+          return;
+        }
+        std::deque<job> &queue = m_urgent.empty() ? m_queue : m_urgent;
+        j = std::move(queue.front());
+        queue.pop_front();
+        // Already answered (timed out or withdrawn), or past its deadline
+        // and about to be; don't spend credits on it
+        if (m_in_flight.count(j.id) == 0 ||
+            std::chrono::steady_clock::now() >= j.deadline) {
+          continue;
+        }
+      }
+
+      exchange_reply reply;
+      if (j.urgent) {
+        m_scheduler.charge(j.cls);
+      } else if (!m_scheduler.acquire(j.cls, j.deadline)) {
+        reply.sent = false;
+        complete(j.id, reply);
+        continue;
+      }
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_in_flight.find(j.id);
+        if (it == m_in_flight.end()) {
+          continue; // timed out or withdrawn while waiting for credits
+        }
+        it->second.sent = true;
+        // Taken last, so the round trip is the exchange's alone
+        it->second.posted = std::chrono::steady_clock::now();
+      }
+      auto res = cli.Post(j.path, j.headers, j.body, "application/json");
+      if (res) {
+        reply.status = res->status;
+        reply.body = std::move(res->body);
+      }
+      complete(j.id, reply);
+    }
+  }
+
+  void complete(uint64_t id, exchange_reply &reply) {
+    reply_handler done;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_in_flight.find(id);
+      if (it == m_in_flight.end()) {
+        return; // timed out
+      }
+      done = std::move(it->second.done);
+      if (it->second.sent) {
+        reply.rtt = std::chrono::steady_clock::now() - it->second.posted;
+        reply.queued = it->second.posted - it->second.submitted;
+      }
+      m_in_flight.erase(it);
+    }
+    done(reply);
+  }
+
+  void reap() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping) {
+      if (m_deadlines.empty()) {
+        m_expiry.wait(lock);
+        continue;
+      }
+      auto deadline = m_deadlines.front().first;
+      if (std::chrono::steady_clock::now() < deadline) {
+        m_expiry.wait_until(lock, deadline);
+        continue;
+      }
+      uint64_t id = m_deadlines.front().second;
+      m_deadlines.pop_front();
+      auto it = m_in_flight.find(id);
+      if (it == m_in_flight.end()) {
+        continue; // already answered
+      }
+      reply_handler done = std::move(it->second.done);
+      exchange_reply reply;
+      reply.timed_out = true;
+      reply.sent = it->second.sent;
+      if (reply.sent) {
+        reply.queued = it->second.posted - it->second.submitted;
+      }
+      m_in_flight.erase(it);
+
+      lock.unlock();
+      done(reply);
+      lock.lock();
+    }
+  }
+
+  const std::string m_url;
+  const std::chrono::milliseconds m_timeout;
+  request_scheduler &m_scheduler;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_work;        // any worker
+  std::condition_variable m_urgent_work; // the reserved worker
+  std::condition_variable m_expiry;
+  std::deque<job> m_queue;
+  std::deque<job> m_urgent;
+  std::unordered_map<uint64_t, pending> m_in_flight;
+  std::deque<std::pair<std::chrono::steady_clock::time_point, uint64_t>>
+      m_deadlines;
+  bool m_stopping = false;
+  std::vector<std::thread> m_workers;
+  std::thread m_reaper;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Raw cycle counter: a single instruction, no syscall and no vDSO, so it can
+// be read at every stage of an order without perturbing what it measures.
+inline uint64_t tsc_now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Counter ticks per nanosecond, measured once against steady_clock. The
+// first call sleeps for 20ms, so make it at startup, not on an order.
+inline double tsc_ticks_per_ns() {
+  static const double ratio = [] {
+    auto wall_start = std::chrono::steady_clock::now();
+    uint64_t ticks_start = tsc_now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uint64_t ticks = tsc_now() - ticks_start;
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - wall_start)
+                    .count();
+    return ticks / ns;
+  }();
+  return ratio;
+}
+
+// Timestamps taken as one place_order moves through the server, from the
+// moment its message is picked up to the open_orders_update it triggers.
+class order_trace {
+public:
+  enum stage {
+    received,
+    parsed,
+    validated,
+    acked,
+    request_built,
+    token,
+    exchange,
+    serialized,
+    sent,
+    open_orders_update,
+    stage_count
+  };
+
+  order_trace() : m_stamps() { m_stamps[received] = tsc_now(); }
+
+  void mark(stage s) { m_stamps[s] = tsc_now(); }
+
+  // Microseconds from receipt to each stage reached so far
+  nlohmann::json to_json() const {
+    static const char *const names[stage_count] = {
+        "received",      "parsed", "validated", "acked",
+        "request_built", "token",  "exchange",  "serialized",
+        "sent",          "open_orders_update"};
+    const double ticks_per_us = tsc_ticks_per_ns() * 1000.0;
+    nlohmann::json stages = nlohmann::json::object();
+    for (int s = parsed; s < stage_count; ++s) {
+      if (m_stamps[s]) {
+        double us = (m_stamps[s] - m_stamps[received]) / ticks_per_us;
+        stages[names[s]] = std::round(us * 100) / 100;
+      }
+    }
+    return stages;
+  }
+
+private:
+  uint64_t m_stamps[stage_count];
+};
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "fixed_point.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <nlohmann/json.hpp>
+#include <string>
+
+// Message handling that does not touch sockets or the exchange: classifying
+// client requests, turning a client order into an exchange request, and the
+// shape of outgoing market data. Kept out of server.cpp so the benchmarks can
+// time these pieces in isolation.
+
+enum class request_type {
+  echo,
+  get_instruments,
+  place_order,
+  modify_order,
+  cancel_order,
+  place_orders,
+  cancel_orders,
+  cancel_all_by_instrument,
+  cancel_on_disconnect,
+  kill_switch,
+  unknown
+};
+
+// Most orders or cancels one place_orders or cancel_orders message may carry
+const size_t max_batch_size = 100;
+
+inline request_type parse_request_type(const std::string &type) {
+  if (type == "echo") {
+    return request_type::echo;
+  } else if (type == "place_order") {
+    return request_type::place_order;
+  } else if (type == "modify_order") {
+    return request_type::modify_order;
+  } else if (type == "cancel_order") {
+    return request_type::cancel_order;
+  } else if (type == "get_instruments") {
+    return request_type::get_instruments;
+  } else if (type == "place_orders") {
+    return request_type::place_orders;
+  } else if (type == "cancel_orders") {
+    return request_type::cancel_orders;
+  } else if (type == "cancel_all_by_instrument") {
+    return request_type::cancel_all_by_instrument;
+  } else if (type == "cancel_on_disconnect") {
+    return request_type::cancel_on_disconnect;
+  } else if (type == "kill_switch") {
+    return request_type::kill_switch;
+  }
+  return request_type::unknown;
+}
+
+// Checks a place_order request's "data" object. Returns the error to report
+// to the client, or an empty string if the order can be sent.
+inline std::string validate_order(const nlohmann::json &order_data) {
+  static const char *const required[] = {"instrument_name", "amount", "type",
+                                         "direction"};
+  for (const char *field : required) {
+    if (!order_data.contains(field)) {
+      return std::string("Missing required field: ") + field;
+    }
+  }
+  if (order_data["type"] == "limit" && !order_data.contains("price")) {
+    return "Price is required for limit orders";
+  }
+  return std::string();
+}
+
+// Reads a JSON number as an exact decimal. False for anything else.
+//
+// nlohmann has already parsed the number to a double, and from_double gives
+// back the written decimal only if it had at most 15 significant digits or
+// was the shortest text for its double, as machine-written JSON is. Messages
+// typed by clients go through inexact_number first.
+inline bool json_decimal(const nlohmann::json &value, decimal &out) {
+  return value.is_number() && decimal::from_double(value.get<double>(), out);
+}
+
+// The first number in `text`, a JSON document that has already parsed,
+// whose own digits read by decimal::parse differ from what json_decimal
+// makes of it, or an empty string if there is none. Sees each number as
+// written, which the parsed document no longer has: "50000.00000000000001"
+// is the double 50000, and "12345678901.23456789" one that reads back as
+// 12345678901.234568. A message it flags is refused, so every decimal read
+// from the rest is the one the client wrote.
+//
+// A number with at most 15 significant digits always reads back as
+// written, so only longer ones are parsed twice; the scan itself allocates
+// nothing.
+inline std::string inexact_number(const std::string &text) {
+  const char *p = text.data();
+  const char *end = p + text.size();
+  while (p != end) {
+    if (*p == '"') {
+      for (++p; p != end && *p != '"'; ++p) {
+        if (*p == '\\' && p + 1 != end) {
+          ++p;
+        }
+      }
+      if (p != end) {
+        ++p;
+      }
+      continue;
+    }
+    if (*p != '-' && (*p < '0' || *p > '9')) {
+      ++p;
+      continue;
+    }
+    const char *begin = p;
+    int digits = 0; // significant digits before any exponent
+    bool mantissa = true;
+    for (; p != end; ++p) {
+      if (*p >= '0' && *p <= '9') {
+        if (mantissa && (digits > 0 || *p != '0')) {
+          ++digits;
+        }
+      } else if (*p == 'e' || *p == 'E') {
+        mantissa = false;
+      } else if (*p != '.' && *p != '+' && *p != '-') {
+        break;
+      }
+    }
+    if (digits > 15) {
+      std::string number(begin, p);
+      decimal exact, read;
+      bool parsed = decimal::parse(begin, p, exact);
+      if (decimal::from_double(std::strtod(number.c_str(), nullptr), read) &&
+          (!parsed || read != exact)) {
+        return number;
+      }
+    }
+  }
+  return std::string();
+}
+
+// Client order IDs assigned by the server when it accepts an order, or with
+// another `kind` letter, other labels it puts on orders. The prefix is the
+// process start time, so IDs stay unique across restarts; the whole ID stays
+// well inside the exchange's 64 character label limit.
+class client_order_ids {
+public:
+  explicit client_order_ids(char kind = 'o')
+      : m_prefix(kind +
+                 std::to_string(
+                     std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::system_clock::now().time_since_epoch())
+                         .count()) +
+                 "-") {}
+
+  std::string next() {
+    return m_prefix +
+           std::to_string(m_next.fetch_add(1, std::memory_order_relaxed));
+  }
+
+private:
+  std::string m_prefix;
+  std::atomic<uint64_t> m_next{1};
+};
+
+// JSON-RPC body for private/buy or private/sell. Assumes validate_order
+// passed. The client order ID is sent as the order's label, which the
+// exchange reports back on the order, so its view can be matched to ours,
+// unless another `label` is given.
+inline nlohmann::json build_order_request(const nlohmann::json &order_data,
+                                          const std::string &client_order_id,
+                                          uint64_t request_id,
+                                          const std::string &label = "") {
+  nlohmann::json request = {
+      {"jsonrpc", "2.0"},
+      {"id", request_id},
+      {"method", order_data["direction"] == "buy" ? "private/buy"
+                                                  : "private/sell"},
+      {"params",
+       {{"instrument_name", order_data["instrument_name"]},
+        {"amount", order_data["amount"]},
+        {"type", order_data["type"]},
+        {"label", label.empty() ? client_order_id : label}}}};
+
+  // Add price only for limit orders
+  if (order_data["type"] == "limit") {
+    request["params"]["price"] = order_data["price"];
+  }
+  return request;
+}
+
+// Reused for every orderbook_update so only the changing fields are
+// rewritten per update.
+inline nlohmann::json orderbook_update_template() {
+  return {{"type", "orderbook_update"},
+          {"instrument", ""},
+          {"timestamp", 0},
+          {"latency", nullptr},
+          {"data", nullptr}};
+}
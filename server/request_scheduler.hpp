@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// What an exchange request is for, highest priority first
+enum class request_class : uint8_t {
+  order,       // buy, sell, edit
+  cancel,      // cancel, cancel_all_by_instrument
+  account,     // positions, open orders, instruments a client is waiting on
+  market_data, // order book polls, instrument refreshes
+  count
+};
+
+// One of the exchange's credit pools as a token bucket: up to `burst`
+// requests at once, refilled at `per_second`. Deribit states its limits in
+// credits (e.g. 500 a request, 50000 at most, refilled at 10000/s), which
+// is the same bucket counted in requests: a burst of 100 at 20 a second.
+struct credit_pool {
+  double burst = 0;
+  double per_second = 0;
+};
+
+// Spends the exchange's rate limit credits on the requests that matter most.
+//
+// Deribit meters matching engine requests (orders, edits, cancels) and
+// everything else in separate pools, so the scheduler keeps a bucket for
+// each. Within a pool a lower priority class may not spend the last part of
+// the bucket: cancels leave the last 10% of the matching pool to orders,
+// and market data polls leave the bottom half of the other pool to account
+// requests. When credits run low, polling is therefore shed first and
+// orders last.
+//
+// Pollers call try_acquire() and skip the request if it refuses. The order
+// gateway calls acquire(), which waits for credits up to a deadline. With no
+// limits set every request is allowed at once.
+class request_scheduler {
+public:
+  // Deribit's default limits for an account on the lowest tier
+  static credit_pool deribit_matching() { return {20, 5}; }
+  static credit_pool deribit_non_matching() { return {100, 20}; }
+
+  // Reads limits from a JSON file of the form
+  //   {"matching": {"burst": 20, "per_second": 5},
+  //    "non_matching": {"burst": 100, "per_second": 20}}
+  // Throws if the file can't be read or parsed.
+  void load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) {
+      throw std::runtime_error("cannot open rate limits " + path);
+    }
+    nlohmann::json config = nlohmann::json::parse(in);
+    auto pool = [&](const char *name) {
+      const nlohmann::json &p = config.at(name);
+      return credit_pool{p.at("burst").get<double>(),
+                         p.at("per_second").get<double>()};
+    };
+    set_limits(pool("matching"), pool("non_matching"));
+  }
+
+  // Call before any request is scheduled
+  void set_limits(credit_pool matching, credit_pool non_matching) {
+    m_pools[0].reset(matching);
+    m_pools[1].reset(non_matching);
+    m_limited = true;
+  }
+
+  bool limited() const { return m_limited; }
+
+  // Spends one request's credits if the class may. Never waits.
+  bool try_acquire(request_class c) {
+    return !m_limited || pool(c).take(floor(c)) == 0;
+  }
+
+  // Spends one request's credits, waiting for the bucket to refill if it
+  // must. Returns false at once if that would take past `deadline`.
+  bool acquire(request_class c,
+               std::chrono::steady_clock::time_point deadline) {
+    if (!m_limited) {
+      return true;
+    }
+    for (;;) {
+      double wait_s = pool(c).take(floor(c));
+      if (wait_s == 0) {
+        return true;
+      }
+      auto ready = std::chrono::steady_clock::now() +
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::duration<double>(wait_s));
+      if (ready > deadline) {
+        return false;
+      }
+      std::this_thread::sleep_until(ready);
+    }
+  }
+
+  // Spends one request's credits whether or not there are any, for requests
+  // that can't be skipped. Others wait for the debt to refill.
+  void charge(request_class c) {
+    if (m_limited) {
+      pool(c).force();
+    }
+  }
+
+private:
+  class bucket {
+  public:
+    void reset(credit_pool limit) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_limit = limit;
+      m_level = limit.burst;
+      m_updated = std::chrono::steady_clock::now();
+    }
+
+    double burst() const { return m_limit.burst; }
+
+    // Takes one request if at least `floor` would be left. Returns 0 if it
+    // did, or else the seconds until it could.
+    double take(double floor) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      refill();
+      double short_by = floor + 1 - m_level;
+      if (short_by <= 0) {
+        m_level -= 1;
+        return 0;
+      }
+      // A pool with no refill never has room again
+      return m_limit.per_second > 0 ? short_by / m_limit.per_second : 1e9;
+    }
+
+    void force() {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      refill();
+      m_level -= 1;
+    }
+
+  private:
+    void refill() {
+      auto now = std::chrono::steady_clock::now();
+      m_level = std::min(
+          m_limit.burst,
+          m_level + m_limit.per_second *
+                        std::chrono::duration<double>(now - m_updated).count());
+      m_updated = now;
+    }
+
+    std::mutex m_mutex;
+    credit_pool m_limit;
+    double m_level = 0;
+    std::chrono::steady_clock::time_point m_updated;
+  };
+
+  bucket &pool(request_class c) {
+    return m_pools[c == request_class::order || c == request_class::cancel
+                       ? 0
+                       : 1];
+  }
+
+  // Credits a class must leave in its pool
+  double floor(request_class c) {
+    static const double reserved[] = {0, 0.1, 0, 0.5};
+    return reserved[static_cast<int>(c)] * pool(c).burst();
+  }
+
+  bool m_limited = false;
+  bucket m_pools[2]; // matching engine, everything else
+};
@@ -0,0 +1,303 @@
+#pragma once
+
+#include "fixed_point.hpp"
+#include "instrument_registry.hpp"
+#include "protocol.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+// Limits for one instrument. A zero limit is not checked.
+struct risk_limits {
+  decimal max_amount;        // largest amount in one order
+  double max_notional = 0;   // see pre_trade_risk::check
+  double price_band = 0;     // largest distance of a limit price from mid,
+                             // as a fraction of mid
+  uint32_t max_open_orders = 0;
+};
+
+// Pre-trade checks run before an order is sent to the exchange, so orders
+// the exchange or the desk would refuse are rejected locally.
+//
+// Everything a check reads is in arrays indexed by instrument_id: the
+// instrument's increments in the registry, and here its limits, the mid of
+// its latest book, its open order count and its pending order count. Index
+// prices, which value orders in USD, are kept per currency, since every
+// book of a currency's instruments carries the same one. A check is a
+// handful of loads and integer compares. The feed thread writes mids and
+// indexes, the open orders refresh writes counts and gateway threads
+// release pending orders while orders are checked, so those are relaxed
+// atomics.
+class pre_trade_risk {
+public:
+  explicit pre_trade_risk(const instrument_registry &instruments)
+      : m_instruments(instruments),
+        m_limits(new std::atomic<const risk_limits *>[table_size]()),
+        m_mid(new std::atomic<int64_t>[table_size]()),
+        m_open_orders(new std::atomic<uint32_t>[table_size]()),
+        m_pending(new std::atomic<uint32_t>[table_size]()) {}
+
+  // Reads limits from a JSON file of the form
+  //   {"default": {"max_amount": 1000000, "max_notional": 1000000,
+  //                "price_band_pct": 5, "max_open_orders": 50},
+  //    "instruments": {"BTC-PERPETUAL": {"max_amount": 5000000}}}
+  // An instrument's entry overrides the default field by field. Call before
+  // checking any order. Throws if the file can't be read or parsed.
+  void load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) {
+      throw std::runtime_error("cannot open risk limits " + path);
+    }
+    nlohmann::json config = nlohmann::json::parse(in);
+    m_default = parse_limits(config.value("default", nlohmann::json::object()),
+                             risk_limits());
+    const nlohmann::json instruments =
+        config.value("instruments", nlohmann::json::object());
+    for (const auto &it : instruments.items()) {
+      m_overrides[it.key()] = parse_limits(it.value(), m_default);
+    }
+  }
+
+  // Records the mid and index price of an instrument's latest book, a
+  // get_order_book result
+  void on_book(instrument_id id, const nlohmann::json &book) {
+    decimal bid, ask, index;
+    if (best_price(book, "bids", bid) && best_price(book, "asks", ask)) {
+      m_mid[id].store((bid.units() + ask.units()) / 2,
+                      std::memory_order_relaxed);
+    }
+    size_t c = currency_of(id);
+    if (c != no_currency && book.contains("index_price") &&
+        json_decimal(book["index_price"], index)) {
+      m_index[c].price.store(index.units(), std::memory_order_relaxed);
+    }
+  }
+
+  // Replaces the open order counts of one currency's instruments from the
+  // result of private/get_open_orders_by_currency
+  void set_open_orders(const std::string &currency,
+                       const nlohmann::json &orders) {
+    std::unordered_map<instrument_id, uint32_t> counts;
+    for (const auto &order : orders) {
+      instrument_id id =
+          m_instruments.find(order.value("instrument_name", std::string()));
+      if (id != no_instrument) {
+        ++counts[id];
+      }
+    }
+    for (instrument_id id = 0; id < m_instruments.size(); ++id) {
+      if (m_instruments.name(id).compare(0, currency.size(), currency) == 0) {
+        auto it = counts.find(id);
+        m_open_orders[id].store(it == counts.end() ? 0 : it->second,
+                                std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Counts an order that passed check() toward the instrument's open
+  // orders until the exchange has answered it. The open order count only
+  // catches up on the next refresh, so without this a burst of orders would
+  // all be checked against the same stale count.
+  void reserve(instrument_id id) {
+    m_pending[id].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Ends a reserve() once the exchange has acknowledged or rejected the
+  // order, or it has timed out
+  void release(instrument_id id) {
+    m_pending[id].fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Checks an order that passed validate_order. Returns the reason to
+  // reject it, or an empty string.
+  //
+  // Notional is in USD for every instrument; see notional(). An order it
+  // can't value yet, such as a market order on an instrument with no book
+  // or index seen, is rejected while a notional limit applies.
+  std::string check(instrument_id id,
+                    const nlohmann::json &order_data) const {
+    decimal amount;
+    int64_t count;
+    if (!json_decimal(order_data["amount"], amount) || amount <= decimal()) {
+      return "Invalid amount";
+    }
+    decimal min_trade_amount = m_instruments.min_trade_amount(id);
+    if (amount < min_trade_amount) {
+      return "Amount is below the minimum trade amount " +
+             min_trade_amount.to_string();
+    }
+    decimal lot_size = m_instruments.lot_size(id);
+    if (lot_size > decimal() && !amount.steps(lot_size, count)) {
+      return "Amount must be a multiple of the lot size " +
+             lot_size.to_string() + ", such as " +
+             nearest(amount, lot_size).to_string();
+    }
+
+    const bool limit = order_data["type"] == "limit";
+    decimal price;
+    if (limit) {
+      if (!json_decimal(order_data["price"], price) || price <= decimal()) {
+        return "Invalid price";
+      }
+      decimal tick_size = m_instruments.tick_size(id);
+      if (tick_size > decimal() && !price.steps(tick_size, count)) {
+        return "Price must be a multiple of the tick size " +
+               tick_size.to_string() + ", such as " +
+               nearest(price, tick_size).to_string();
+      }
+    }
+
+    const risk_limits &l = limits(id);
+    if (l.max_amount > decimal() && amount > l.max_amount) {
+      return "Amount exceeds the limit of " + l.max_amount.to_string();
+    }
+
+    decimal mid =
+        decimal::from_units(m_mid[id].load(std::memory_order_relaxed));
+    if (limit && l.price_band > 0 && mid > decimal()) {
+      double distance =
+          std::fabs(price.to_double() - mid.to_double()) / mid.to_double();
+      if (distance > l.price_band) {
+        return "Price is more than " + number(l.price_band * 100) +
+               "% from the mid " + mid.to_string();
+      }
+    }
+
+    if (l.max_notional > 0) {
+      double value = notional(id, amount, limit ? price : decimal(), mid);
+      if (value < 0) {
+        return "No price known yet to check the notional against";
+      } else if (value > l.max_notional) {
+        return "Notional " + number(value) + " USD exceeds the limit of " +
+               number(l.max_notional);
+      }
+    }
+
+    if (l.max_open_orders > 0 &&
+        m_open_orders[id].load(std::memory_order_relaxed) +
+                m_pending[id].load(std::memory_order_relaxed) >=
+            l.max_open_orders) {
+      return "Already at the limit of " + std::to_string(l.max_open_orders) +
+             " open orders";
+    }
+    return std::string();
+  }
+
+private:
+  static const instrument_id table_size = instrument_registry::max_instruments;
+
+  struct currency_index {
+    const char *currency;
+    std::atomic<int64_t> price{0};
+  };
+
+  static const size_t currencies = 4;
+  static const size_t no_currency = currencies;
+
+  // Slot in m_index of the currency an instrument's name starts with, as
+  // in "BTC-PERPETUAL" or "BTC_USDC", or no_currency
+  size_t currency_of(instrument_id id) const {
+    const std::string &name = m_instruments.name(id);
+    for (size_t c = 0; c < currencies; ++c) {
+      size_t n = std::strlen(m_index[c].currency);
+      if (name.size() > n && name.compare(0, n, m_index[c].currency) == 0 &&
+          (name[n] == '-' || name[n] == '_')) {
+        return c;
+      }
+    }
+    return no_currency;
+  }
+
+  // An order's notional in USD, or -1 if there is no price to value it at.
+  // Inverse futures have amounts in USD already: a whole number of
+  // contracts of contract_size USD each. Other amounts are in the base
+  // currency and are valued at its USD index price. Without an index, a
+  // spot pair or linear future falls back on its own price, the limit price
+  // if given (`price` is zero for market orders) or else the mid, since it
+  // is quoted in USD per coin; an option's price is a premium, so an option
+  // needs the index.
+  double notional(instrument_id id, decimal amount, decimal price,
+                  decimal mid) const {
+    if (m_instruments.usd_amounts(id)) {
+      return amount.to_double();
+    }
+    size_t c = currency_of(id);
+    decimal per_unit;
+    if (c != no_currency) {
+      per_unit = decimal::from_units(
+          m_index[c].price.load(std::memory_order_relaxed));
+    }
+    instrument_kind kind = m_instruments.kind(id);
+    if (per_unit <= decimal() && kind != instrument_kind::option &&
+        kind != instrument_kind::option_combo) {
+      per_unit = price > decimal() ? price : mid;
+    }
+    if (per_unit <= decimal()) {
+      return -1;
+    }
+    return amount.to_double() * per_unit.to_double();
+  }
+
+  static risk_limits parse_limits(const nlohmann::json &config,
+                                  risk_limits limits) {
+    if (config.contains("max_amount") &&
+        !json_decimal(config["max_amount"], limits.max_amount)) {
+      throw std::runtime_error("risk limits: bad max_amount");
+    }
+    limits.max_notional = config.value("max_notional", limits.max_notional);
+    limits.price_band =
+        config.value("price_band_pct", limits.price_band * 100) / 100;
+    limits.max_open_orders =
+        config.value("max_open_orders", limits.max_open_orders);
+    return limits;
+  }
+
+  static bool best_price(const nlohmann::json &book, const char *side,
+                         decimal &price) {
+    auto it = book.find(side);
+    return it != book.end() && it->is_array() && !it->empty() &&
+           (*it)[0].is_array() && !(*it)[0].empty() &&
+           json_decimal((*it)[0][0], price);
+  }
+
+  // The valid value nearest a rejected one, to suggest in the reason
+  static decimal nearest(decimal value, decimal step) {
+    decimal rounded = value.round_to(step);
+    return rounded > decimal() ? rounded : step;
+  }
+
+  static std::string number(double value) {
+    char text[32];
+    return std::string(text, std::snprintf(text, sizeof(text), "%.15g", value));
+  }
+
+  // Resolved from the overrides on first use. Racing threads store the
+  // same pointer, and the pointees live as long as the engine.
+  const risk_limits &limits(instrument_id id) const {
+    const risk_limits *l = m_limits[id].load(std::memory_order_acquire);
+    if (!l) {
+      auto it = m_overrides.find(m_instruments.name(id));
+      l = it == m_overrides.end() ? &m_default : &it->second;
+      m_limits[id].store(l, std::memory_order_release);
+    }
+    return *l;
+  }
+
+  const instrument_registry &m_instruments;
+  risk_limits m_default;
+  std::unordered_map<std::string, risk_limits> m_overrides;
+  std::unique_ptr<std::atomic<const risk_limits *>[]> m_limits;
+  std::unique_ptr<std::atomic<int64_t>[]> m_mid;
+  std::unique_ptr<std::atomic<uint32_t>[]> m_open_orders;
+  std::unique_ptr<std::atomic<uint32_t>[]> m_pending;
+  currency_index m_index[currencies] = {
+      {"BTC"}, {"ETH"}, {"USDC"}, {"USDT"}};
+};
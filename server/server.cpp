@@ -1,23 +1,152 @@
+#include "broadcast_compressor.hpp"
 #include "httplib.h"
+#include "instrument_registry.hpp"
+#include "line_writer.hpp"
+#include "market_journal.hpp"
+#include "market_replay.hpp"
+#include "metrics.hpp"
+#include "order_gateway.hpp"
+#include "order_trace.hpp"
+#include "protocol.hpp"
+#include "request_scheduler.hpp"
+#include "risk_checks.hpp"
+#include "server_config.hpp"
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
 #include <mutex>
 #include <nlohmann/json.hpp>
-#include <set>
 #include <string>
-#include <unordered_set>
+#include <sys/resource.h>
+#include <unordered_map>
 #include <vector>
-#include <websocketpp/config/asio_no_tls.hpp>
 #include <websocketpp/server.hpp>
 
 #define CLIENT_ID ""
 #define CLIENT_SECRET "";
 
 using json = nlohmann::json;
-typedef websocketpp::server<websocketpp::config::asio> server;
-typedef std::set<websocketpp::connection_hdl,
-                 std::owner_less<websocketpp::connection_hdl>>
-    con_list;
+typedef websocketpp::server<server_config> server;
+
+// Base URL of the exchange REST API. Set EXCHANGE_URL to run against
+// something else, e.g. http://localhost:8080 for mock_exchange.
+static std::string exchange_url() {
+  const char *url = std::getenv("EXCHANGE_URL");
+  return url && *url ? url : "https://test.deribit.com";
+}
+
+// Port for the Prometheus endpoint, on loopback only. METRICS_PORT=0
+// disables it.
+static int metrics_port() {
+  const char *port = std::getenv("METRICS_PORT");
+  return port && *port ? std::atoi(port) : 9102;
+}
+
+// Where instrument lists are kept between runs, so startup and
+// get_instruments don't wait on the exchange
+static std::string instrument_snapshot_path() {
+  const char *path = std::getenv("INSTRUMENT_SNAPSHOT");
+  return path && *path ? path : "instruments.snapshot.json";
+}
+
+// Recorded market data to play back instead of polling the exchange: a
+// market journal or a JSONL capture of get_order_book responses.
+static const char *replay_source() {
+  const char *path = std::getenv("MARKET_REPLAY");
+  return path && *path ? path : nullptr;
+}
+
+// REPLAY_SPEED=1 plays back at the recorded pace, N at N times that, and
+// "max" (or 0) as fast as the slowest client drains it.
+static double replay_speed() {
+  const char *speed = std::getenv("REPLAY_SPEED");
+  if (!speed || !*speed) {
+    return 1;
+  }
+  return std::strcmp(speed, "max") == 0 ? 0 : std::atof(speed);
+}
+
+// Order requests the gateway may have on the wire at once. ORDER_WORKERS
+// sets it; the exchange's rate limit is the real ceiling.
+static size_t order_workers() {
+  const char *workers = std::getenv("ORDER_WORKERS");
+  int n = workers && *workers ? std::atoi(workers) : 8;
+  return n > 0 ? n : 1;
+}
+
+// How long an order, edit or cancel may wait for the exchange before the
+// client is told it timed out. ORDER_TIMEOUT_MS sets it.
+static std::chrono::milliseconds order_timeout() {
+  const char *timeout = std::getenv("ORDER_TIMEOUT_MS");
+  int ms = timeout && *timeout ? std::atoi(timeout) : 5000;
+  return std::chrono::milliseconds(ms > 0 ? ms : 5000);
+}
+
+// RATE_LIMITS is "deribit" for Deribit's default limits, "off" for none, or
+// the path of a JSON file with others (see request_scheduler::load). The
+// default is Deribit's limits when talking to Deribit and none otherwise,
+// so the mock exchange and replays run flat out.
+static const char *rate_limits() {
+  const char *limits = std::getenv("RATE_LIMITS");
+  if (limits && *limits) {
+    return limits;
+  }
+  return exchange_url().find("deribit.com") != std::string::npos ? "deribit"
+                                                                 : "off";
+}
+
+template <typename clock>
+static int64_t nanoseconds(std::chrono::time_point<clock> t) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             t.time_since_epoch())
+      .count();
+}
+
+// Why orders are refused while the kill switch is engaged
+static const char *const kill_switch_engaged =
+    "Kill switch engaged; no orders are accepted until it is disengaged";
+
+// An answered order whose trace waits for the open orders update it triggers
+struct traced_order {
+  json order;
+  std::string client_order_id;
+  order_trace trace;
+};
+
+// The response to a batch request, filled in part by part as the gateway
+// answers. Parts rejected locally are filled in from the start.
+class batch_reply {
+public:
+  batch_reply(const std::string &type, json results, size_t outstanding)
+      : m_response{{"type", type}, {"results", std::move(results)}},
+        m_outstanding(outstanding) {}
+
+  // Stores one part's result. Returns true for the last one outstanding.
+  bool set(size_t index, json result) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_response["results"][index] = std::move(result);
+    return --m_outstanding == 0;
+  }
+
+  std::string dump() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_response.dump();
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  json m_response;
+  size_t m_outstanding;
+};
+
+// Open connections, each carrying its session. Broadcasts walk this list,
+// so it holds the connections themselves rather than handles to promote.
+typedef std::vector<server::connection_ptr> con_list;
 
 class websocket_server {
 public:
@@ -31,146 +160,379 @@ public:
     m_server.set_message_handler(websocketpp::lib::bind(
         &websocket_server::on_message, this, websocketpp::lib::placeholders::_1,
         websocketpp::lib::placeholders::_2));
+    // Updates are small and latency sensitive; don't let Nagle hold one back
+    // waiting for the ack of the previous one.
+    m_server.set_tcp_post_init_handler([this](websocketpp::connection_hdl hdl) {
+      websocketpp::lib::asio::error_code ec;
+      m_server.get_con_from_hdl(hdl)->get_raw_socket().set_option(
+          websocketpp::lib::asio::ip::tcp::no_delay(true), ec);
+    });
+
+    // Calibrate the cycle counter now rather than on the first order
+    tsc_ticks_per_ns();
+    const char *trace_path = std::getenv("ORDER_TRACE_LOG");
+    if (trace_path && *trace_path) {
+      m_trace_file.open(trace_path, std::ios::app);
+      m_trace_log.reset(new line_writer(&m_trace_file));
+    }
 
-    // m_server.clear_access_channels(websocketpp::log::alevel::all);
-    // m_server.set_access_channels(websocketpp::log::alevel::fail);
-    // m_server.clear_error_channels(websocketpp::log::elevel::all);
-    // m_server.set_error_channels(websocketpp::log::elevel::fatal);
+    const char *journal_path = std::getenv("MARKET_JOURNAL");
+    if (journal_path && *journal_path) {
+      m_journal.reset(
+          new market_journal(journal_path, [this](const std::string &error) {
+            m_server.get_elog().write(websocketpp::log::elevel::rerror, error);
+          }));
+    }
 
-    fetch_instruments();
+    if (replay_source()) {
+      m_replay.reset(new market_replay(replay_source(), replay_speed()));
+    }
+
+    // Serve and poll from the snapshot right away; the refresh thread
+    // fetches current lists in the background
+    m_instruments.load();
+
+    const char *risk_path = std::getenv("RISK_LIMITS");
+    if (risk_path && *risk_path) {
+      m_risk.load(risk_path);
+    }
+
+    std::string limits = rate_limits();
+    if (limits == "deribit") {
+      m_scheduler.set_limits(request_scheduler::deribit_matching(),
+                             request_scheduler::deribit_non_matching());
+    } else if (limits != "off") {
+      m_scheduler.load(limits);
+    }
   }
 
   void run(uint16_t port) {
+    // Replay and benchmark runs restart the server back to back; don't wait
+    // out TIME_WAIT from the previous run's connections.
+    m_server.set_reuse_addr(true);
     m_server.listen(port);
     m_server.start_accept();
 
-    std::thread orderbook_thread(&websocket_server::orderbook_update_loop,
+    std::thread orderbook_thread(m_replay
+                                     ? &websocket_server::replay_loop
+                                     : &websocket_server::orderbook_update_loop,
                                  this);
     std::thread positions_thread(&websocket_server::positions_update_loop,
                                  this);
     std::thread open_orders_thread(&websocket_server::open_orders_update_loop,
                                    this);
+    std::thread instruments_thread(&websocket_server::instrument_refresh_loop,
+                                   this);
+
+    std::thread metrics_thread;
+    if (metrics_port() > 0) {
+      m_metrics_http.Get("/metrics", [this](const httplib::Request &,
+                                            httplib::Response &res) {
+        res.set_content(m_metrics.prometheus(),
+                        "text/plain; version=0.0.4");
+      });
+      metrics_thread = std::thread(
+          [this] { m_metrics_http.listen("127.0.0.1", metrics_port()); });
+    }
 
     m_server.run();
 
     m_done = true;
+    m_metrics_http.stop();
     orderbook_thread.join();
     positions_thread.join();
     open_orders_thread.join();
+    instruments_thread.join();
+    if (metrics_thread.joinable()) {
+      metrics_thread.join();
+    }
   }
 
 private:
-  httplib::SSLClient m_http_client{"test.deribit.com"};
+  httplib::Client m_http_client{exchange_url()};
   const std::vector<int> valid_depths = {1, 5, 10, 20, 50, 100, 1000, 10000};
 
   // Pre-allocated buffers
   std::vector<char> response_buffer;
   std::string path_buffer;
-  json update_template;
-  std::string get_current_time() {
-    auto now = std::chrono::system_clock::now();
-    auto now_c = std::chrono::system_clock::to_time_t(now);
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&now_c), "%Y-%m-%d %H:%M:%S");
-    return ss.str();
-  }
+  // One orderbook_update per instrument ID, its name already rendered, so
+  // publishing only rewrites the fields that change
+  std::vector<json> update_templates;
+
   void on_open(websocketpp::connection_hdl hdl) {
+    server::connection_ptr con = m_server.get_con_from_hdl(hdl);
+    con->deflate = accepts_shared_deflate(
+        con->get_response_header("Sec-WebSocket-Extensions"));
+
     std::lock_guard<std::mutex> lock(m_connections_mutex);
-    m_connections.insert(hdl);
+    m_connections.push_back(std::move(con));
+    m_metrics.set(metrics::connections, m_connections.size());
+  }
+
+  // Shared frames may only be sent if the client's inflater window is at
+  // least as large as the one they were compressed with.
+  bool accepts_shared_deflate(const std::string &extensions) {
+    if (extensions.find("permessage-deflate") == std::string::npos) {
+      return false;
+    }
+    int window_bits = 15;
+    const std::string key = "server_max_window_bits=";
+    auto pos = extensions.find(key);
+    if (pos != std::string::npos) {
+      window_bits = std::atoi(extensions.c_str() + pos + key.size());
+    }
+    return window_bits >= m_compressor.window_bits();
   }
 
   void on_close(websocketpp::connection_hdl hdl) {
-    std::lock_guard<std::mutex> lock(m_connections_mutex);
-    m_connections.erase(hdl);
+    server::connection_ptr con = m_server.get_con_from_hdl(hdl);
+    {
+      std::lock_guard<std::mutex> lock(m_connections_mutex);
+      auto it = std::find(m_connections.begin(), m_connections.end(), con);
+      if (it != m_connections.end()) {
+        *it = std::move(m_connections.back());
+        m_connections.pop_back();
+      }
+      m_metrics.set(metrics::connections, m_connections.size());
+    }
+    m_server.get_elog().write(
+        websocketpp::log::elevel::info,
+        "Session closed: " + std::to_string(con->messages_received) +
+            " messages received, " + std::to_string(con->messages_sent) +
+            " sent, " + std::to_string(con->in_flight) +
+            " exchange requests unanswered");
+    if (!con->cancel_on_disconnect) {
+      return;
+    }
+    std::string label = con->label;
+    // Queued orders would otherwise go out after the cancel and stay open
+    m_gateway.withdraw(con.get());
+    try {
+      mass_cancel(con, "private/cancel_by_label", {{"label", label}},
+                  std::chrono::steady_clock::now(),
+                  [this, label](const exchange_reply &reply) {
+                    json response = request_reply(reply);
+                    m_server.get_elog().write(
+                        response.contains("error")
+                            ? websocketpp::log::elevel::warn
+                            : websocketpp::log::elevel::info,
+                        "Cancel on disconnect for " + label + ": " +
+                            response.dump());
+                  });
+    } catch (const std::exception &e) {
+      m_server.get_elog().write(websocketpp::log::elevel::warn,
+                                "Cancel on disconnect for " + label +
+                                    " failed: " + e.what());
+    }
   }
 
   void on_message(websocketpp::connection_hdl hdl, server::message_ptr msg) {
-    process_message(hdl, msg);
+    m_metrics.add(metrics::messages_received);
+    m_metrics.add(metrics::bytes_received, msg->get_payload().size());
+    // The one handle promotion per message; everything below, including
+    // replies from the gateway, holds the connection itself
+    websocketpp::lib::error_code ec;
+    server::connection_ptr con = m_server.get_con_from_hdl(hdl, ec);
+    if (ec) {
+      return;
+    }
+    con->messages_received.fetch_add(1, std::memory_order_relaxed);
+    process_message(con, msg);
   }
 
-  void process_message(websocketpp::connection_hdl hdl,
-                       server::message_ptr msg) {
+  void process_message(server::connection_ptr con, server::message_ptr msg) {
+    order_trace trace;
     try {
       std::string payload = msg->get_payload();
       json j = json::parse(payload);
       std::string message_type = j["type"];
+      trace.mark(order_trace::parsed);
 
-      if (message_type == "echo") {
+      switch (parse_request_type(message_type)) {
+      case request_type::echo:
         // Echo the message back to the client
         // needed for benchmarking
-        m_server.send(hdl, payload, msg->get_opcode());
-      } else if (message_type == "get_instruments") {
-        std::string currency = j["currency"];
-        std::string kind = j["kind"];
-        std::string instruments_response = fetch_instruments(currency, kind);
-        m_server.send(hdl, instruments_response, msg->get_opcode());
-      } else if (message_type == "modify_order") {
-        std::string modify_response = process_modify_order(payload);
-        m_server.send(hdl, modify_response, msg->get_opcode());
-        broadcast_open_orders_update();
-      } else if (message_type == "cancel_order") {
-        std::string cancel_response = process_cancel_order(payload);
-        m_server.send(hdl, cancel_response, msg->get_opcode());
-        broadcast_open_orders_update();
-      }
-      if (message_type == "place_order") {
-        std::string order_response = process_order(payload);
-        m_server.send(hdl, order_response, msg->get_opcode());
-        broadcast_open_orders_update();
+        send_message(con, payload, msg->get_opcode());
+        break;
+      case request_type::get_instruments:
+        process_get_instruments(con, j);
+        break;
+      // Orders, edits and cancels are answered from the gateway when the
+      // exchange replies; the I/O thread goes straight on to the next message
+      case request_type::modify_order:
+        process_modify_order(con, j);
+        break;
+      case request_type::cancel_order:
+        process_cancel_order(con, j);
+        break;
+      case request_type::place_order:
+        process_order(con, std::move(j), payload, trace);
+        break;
+      case request_type::place_orders:
+        process_place_orders(con, j, payload);
+        break;
+      case request_type::cancel_orders:
+        process_cancel_orders(con, j);
+        break;
+      case request_type::cancel_all_by_instrument:
+        process_cancel_all_by_instrument(con, j);
+        break;
+      case request_type::cancel_on_disconnect:
+        process_cancel_on_disconnect(con, j);
+        break;
+      case request_type::kill_switch:
+        process_kill_switch(con, j);
+        break;
+      case request_type::unknown:
+        break;
       }
     } catch (const std::exception &e) {
-      m_server.send(hdl, "Internal server error", msg->get_opcode());
+      send_message(con, "Internal server error", msg->get_opcode());
     }
   }
 
-  void fetch_instruments() {
-    httplib::SSLClient cli("test.deribit.com");
-    cli.set_connection_timeout(5);
-    cli.set_read_timeout(5);
+  // Fetches one instrument list into the registry. Returns false if the
+  // exchange did not answer with one.
+  bool refresh_instruments(httplib::Client &cli, const std::string &currency,
+                           const std::string &kind) {
+    std::string path =
+        "/api/v2/public/get_instruments?currency=" + currency + "&kind=" + kind;
+    auto res = cli.Get(path.c_str());
+    return res && res->status == 200 &&
+           m_instruments.update(currency, kind, res->body);
+  }
 
-    auto res =
-        cli.Get("/api/v2/public/get_instruments?currency=BTC&kind=future");
+  // Answers from the registry. A list no client has asked for before is
+  // handed to the refresh thread, which fetches it once, replies to every
+  // client waiting on it and keeps it fresh from then on. The currency and
+  // kind go into the exchange URL, so only known values are accepted.
+  void process_get_instruments(server::connection_ptr con,
+                               const json &request) {
+    std::string currency = request.value("currency", "");
+    std::string kind = request.value("kind", "");
+    if (!known_currency(currency) ||
+        parse_instrument_kind(kind) == instrument_kind::unknown) {
+      send_message(con,
+                   json{{"type", "instruments"},
+                        {"error", "Unknown currency or kind"}}
+                       .dump(),
+                   websocketpp::frame::opcode::text);
+      return;
+    }
 
-    if (res && res->status == 200) {
-      json response = json::parse(res->body);
-      m_supported_instruments.clear();
-      for (const auto &instrument : response["result"]) {
-        m_supported_instruments.push_back(
-            instrument["instrument_name"].get<std::string>());
+    auto response = m_instruments.response(currency, kind);
+    if (response) {
+      send_message(con, *response, websocketpp::frame::opcode::text);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_instrument_requests_mutex);
+      m_instrument_requests[{currency, kind}].push_back(std::move(con));
+    }
+    m_instruments_wanted.notify_one();
+  }
+
+  // Fetches the lists clients are waiting on and replies to them
+  bool fetch_requested_instruments(httplib::Client &cli) {
+    std::map<std::pair<std::string, std::string>,
+             std::vector<server::connection_ptr>>
+        requests;
+    {
+      std::lock_guard<std::mutex> lock(m_instrument_requests_mutex);
+      requests.swap(m_instrument_requests);
+    }
+    bool changed = false;
+    for (auto &request : requests) {
+      const std::string &currency = request.first.first;
+      const std::string &kind = request.first.second;
+      auto response = m_instruments.response(currency, kind);
+      if (!response) {
+        // Clients are waiting on this one
+        m_scheduler.charge(request_class::account);
+        if (refresh_instruments(cli, currency, kind)) {
+          changed = true;
+          response = m_instruments.response(currency, kind);
+        }
+      }
+      std::string failed;
+      if (!response) {
+        failed = json{{"type", "instruments"},
+                      {"error", "Failed to fetch instruments"}}
+                     .dump();
+      }
+      for (const auto &con : request.second) {
+        send_message(con, response ? *response : failed,
+                     websocketpp::frame::opcode::text);
       }
     }
+    return changed;
   }
 
-  std::string fetch_instruments(const std::string &currency,
-                                const std::string &kind) {
-    httplib::SSLClient cli("test.deribit.com");
+  // Refetches every instrument list the registry holds, plus the BTC
+  // futures the orderbook loop polls, and saves a snapshot when any changed.
+  // Retries sooner while the futures list has never been loaded. Lists
+  // clients are waiting on are fetched as soon as they are asked for.
+  void instrument_refresh_loop() {
+    const std::chrono::seconds refresh_interval(300);
+    const std::chrono::seconds retry_interval(5);
+    httplib::Client cli(exchange_url());
     cli.set_connection_timeout(5);
     cli.set_read_timeout(5);
 
-    std::string path =
-        "/api/v2/public/get_instruments?currency=" + currency + "&kind=" + kind;
-    auto res = cli.Get(path.c_str());
-
-    if (res && res->status == 200) {
-      json response = json::parse(res->body);
-      response["type"] = "instruments";
-      return response.dump();
-    } else {
-      return json{{"type", "instruments"},
-                  {"error", "Failed to fetch instruments"}}
-          .dump();
+    auto next_refresh = std::chrono::steady_clock::now();
+    while (!m_done) {
+      auto now = std::chrono::steady_clock::now();
+      try {
+        bool changed = fetch_requested_instruments(cli);
+        if (now >= next_refresh) {
+          auto lists = m_instruments.lists();
+          if (!m_instruments.ids("BTC", "future")) {
+            lists.emplace_back("BTC", "future");
+          }
+          bool shed = false;
+          for (const auto &list : lists) {
+            if (!m_scheduler.try_acquire(request_class::market_data)) {
+              // Out of credits; refresh them all again on the next pass
+              m_metrics.add(metrics::requests_shed);
+              shed = true;
+              break;
+            }
+            changed |= refresh_instruments(cli, list.first, list.second);
+          }
+          next_refresh = now + (!shed && m_instruments.ids("BTC", "future")
+                                    ? refresh_interval
+                                    : retry_interval);
+        }
+        if (changed) {
+          m_instruments.save();
+        }
+      } catch (const std::exception &e) {
+        m_server.get_elog().write(websocketpp::log::elevel::rerror,
+                                  std::string("Error in instrument refresh: ") +
+                                      e.what());
+        next_refresh = now + retry_interval;
+      }
+      std::unique_lock<std::mutex> lock(m_instrument_requests_mutex);
+      m_instruments_wanted.wait_for(
+          lock, std::chrono::milliseconds(100),
+          [this] { return !m_instrument_requests.empty(); });
     }
   }
 
   std::string get_access_token() {
     static std::string access_token;
     static std::chrono::steady_clock::time_point token_expiry;
+    // Shared by the I/O thread and the positions and open orders loops
+    static std::mutex token_mutex;
+    std::lock_guard<std::mutex> lock(token_mutex);
 
     if (access_token.empty() ||
         std::chrono::steady_clock::now() >= token_expiry) {
-      httplib::SSLClient cli("test.deribit.com");
+      httplib::Client cli(exchange_url());
       cli.set_connection_timeout(5);
       cli.set_read_timeout(5);
+      // Nothing works without a token, so it is never shed
+      m_scheduler.charge(request_class::account);
 
       const char *client_id = CLIENT_ID;
       const char *client_secret = CLIENT_SECRET;
@@ -199,192 +561,627 @@ private:
     return access_token;
   }
 
-  std::string process_order(const std::string &payload) {
-    static const std::unordered_set<std::string> requiredFields = {
-        "instrument_name", "amount", "type", "direction"};
-    static httplib::SSLClient cli("test.deribit.com");
-    static std::once_flag cli_init_flag;
+  // Checks an order locally and, if it passes, assigns it a client order ID,
+  // acknowledges it to the client with an order_ack and hands it to the
+  // gateway. The order_response follows when the exchange replies, carrying
+  // the same client_order_id; orders rejected before the ack have none.
+  // `order` is the parsed client message and `text` the message as
+  // received. With "debug": true the stage timings so far are returned in
+  // the response as "trace".
+  void process_order(server::connection_ptr con, json order,
+                     const std::string &text, order_trace trace) {
+    std::string client_order_id;
+    instrument_id reserved = no_instrument;
+    auto reject = [&](const std::string &error) {
+      release_order(reserved);
+      send_message(con, order_error(client_order_id, error),
+                   websocketpp::frame::opcode::text);
+      trace.mark(order_trace::sent);
+      record_trace(order, client_order_id, trace);
+    };
 
     try {
-      const json order = json::parse(payload);
-
       if (!order.contains("data")) {
-        return R"({"type": "order_response", "error": "Invalid order format: 'data' field missing"})";
+        return reject("Invalid order format: 'data' field missing");
       }
 
+      if (m_kill_switch) {
+        return reject(kill_switch_engaged);
+      }
+      std::string inexact = inexact_number(text);
+      if (!inexact.empty()) {
+        return reject(inexact_error(inexact));
+      }
       const auto &orderData = order["data"];
 
-      // Check for required fields
-      for (const auto &field : requiredFields) {
-        if (!orderData.contains(field)) {
-          return R"({"type": "order_response", "error": "Missing required field: )" +
-                 field + R"("})";
-        }
+      std::string invalid = check_order(orderData, reserved);
+      if (!invalid.empty()) {
+        return reject(invalid);
       }
+      trace.mark(order_trace::validated);
+
+      client_order_id = m_client_order_ids.next();
+      send_message(con,
+                   json{{"type", "order_ack"},
+                        {"client_order_id", client_order_id},
+                        {"data", orderData}}
+                       .dump(),
+                   websocketpp::frame::opcode::text);
+      trace.mark(order_trace::acked);
+
+      uint64_t rpc_id = ++m_rpc_id;
+      json request = build_order_request(orderData, client_order_id, rpc_id,
+                                         con->label);
+      std::string body = request.dump();
+      trace.mark(order_trace::request_built);
+
+      httplib::Headers headers = auth_headers();
+      trace.mark(order_trace::token);
+
+      submit(con, rpc_id, request["method"], std::move(headers),
+             std::move(body),
+             [this, con, order, trace, client_order_id,
+              reserved](const exchange_reply &reply) mutable {
+               release_order(reserved);
+               finish_order(con, order, trace, client_order_id, reply);
+             });
+      reserved = no_instrument; // now released by the reply
+    } catch (const std::exception &e) {
+      reject("Error processing order: " + std::string(e.what()));
+    }
+  }
 
-      // Initialize client once
-      std::call_once(cli_init_flag, [&]() {
-        cli.set_connection_timeout(20);
-        cli.set_read_timeout(20);
-      });
+  // Runs the local checks on one order's data. Returns the reason to reject
+  // it, or an empty string. An order that passes counts toward its
+  // instrument's open orders from here on: `reserved` is set to the
+  // instrument, to be passed to release_order once the exchange has
+  // answered or the order is abandoned. Runs on the I/O thread only, so a
+  // check and its reservation can't interleave with another order's.
+  std::string check_order(const json &orderData, instrument_id &reserved) {
+    reserved = no_instrument;
+    std::string invalid = validate_order(orderData);
+    if (!invalid.empty()) {
+      return invalid;
+    }
+    instrument_id id = m_instruments.find(orderData["instrument_name"]);
+    // Instruments not in any loaded list are left for the exchange to judge
+    if (id == no_instrument) {
+      return invalid;
+    }
+    invalid = m_risk.check(id, orderData);
+    if (!invalid.empty()) {
+      m_metrics.add(metrics::orders_rejected);
+    } else {
+      m_risk.reserve(id);
+      reserved = id;
+    }
+    return invalid;
+  }
 
-      json request_body = {{"jsonrpc", "2.0"},
-                           {"id", 5275},
-                           {"method", orderData["direction"] == "buy"
-                                          ? "private/buy"
-                                          : "private/sell"},
-                           {"params",
-                            {{"instrument_name", orderData["instrument_name"]},
-                             {"amount", orderData["amount"]},
-                             {"type", orderData["type"]},
-                             {"label", "ui_order"}}}};
-
-      // Add price only for limit orders
-      if (orderData["type"] == "limit") {
-        if (!orderData.contains("price")) {
-          return R"({"type": "order_response", "error": "Price is required for limit orders"})";
+  void release_order(instrument_id id) {
+    if (id != no_instrument) {
+      m_risk.release(id);
+    }
+  }
+
+  // Answers an order once the gateway has the exchange's reply, and has the
+  // open orders it changed pushed to every client
+  void finish_order(server::connection_ptr con, const json &order,
+                    order_trace &trace, const std::string &client_order_id,
+                    const exchange_reply &reply) {
+    trace.mark(order_trace::exchange);
+    try {
+      std::string serialized;
+      std::string error = order_reply_error(reply);
+      if (error.empty()) {
+        json response = json::parse(reply.body);
+        response["type"] = "order_response";
+        response["client_order_id"] = client_order_id;
+        if (order.value("debug", false)) {
+          response["trace"] = trace.to_json();
         }
-        request_body["params"]["price"] = orderData["price"];
+        serialized = response.dump();
+        trace.mark(order_trace::serialized);
+      } else {
+        serialized = order_error(client_order_id, error);
       }
+      send_message(con, serialized, websocketpp::frame::opcode::text);
+      trace.mark(order_trace::sent);
+    } catch (const std::exception &e) {
+      send_message(con,
+                   order_error(client_order_id, "Error processing order: " +
+                                                    std::string(e.what())),
+                   websocketpp::frame::opcode::text);
+    }
+    request_open_orders_update(
+        traced_order{order, client_order_id, std::move(trace)});
+  }
 
-      const std::string access_token = get_access_token();
-      httplib::Headers headers = {{"Authorization", "Bearer " + access_token}};
+  // Why an order with a number inexact_number flagged is refused
+  static std::string inexact_error(const std::string &number) {
+    return "Number " + number + " can't be read exactly; prices and amounts "
+           "take at most 8 decimal places and 15 significant digits";
+  }
 
-      auto res = cli.Post("/api/v2/private/buy", headers, request_body.dump(),
-                          "application/json");
+  // Why the exchange did not take an order, or an empty string if it did
+  static std::string order_reply_error(const exchange_reply &reply) {
+    if (reply.withdrawn) {
+      return "Withdrawn by a mass cancel before reaching the exchange; the "
+             "order was not placed";
+    } else if (!reply.sent) {
+      return reply.timed_out ? "Timed out before reaching the exchange; the "
+                               "order was not placed"
+                             : "Exchange rate limit reached; the order was "
+                               "not placed";
+    } else if (reply.timed_out) {
+      return "Timed out waiting for the exchange; the order may still have "
+             "been placed";
+    } else if (reply.status == 0) {
+      return "No response from Deribit API";
+    } else if (reply.status != 200) {
+      return "Failed to process order: " + reply.body;
+    }
+    return std::string();
+  }
 
-      if (res) {
-        if (res->status == 200) {
-          json response = json::parse(res->body);
-          response["type"] = "order_response";
-          return response.dump();
+  // An order_response reporting an error. Orders rejected before the ack
+  // have no client_order_id.
+  static std::string order_error(const std::string &client_order_id,
+                                 const std::string &error) {
+    json response = {{"type", "order_response"}, {"error", error}};
+    if (!client_order_id.empty()) {
+      response["client_order_id"] = client_order_id;
+    }
+    return response.dump();
+  }
+
+  // Places every order of a place_orders message at once. The orders that
+  // pass the local checks are acknowledged together in one place_orders_ack,
+  // and a single place_orders_response follows once the exchange has
+  // answered them all, with one result per order in request order. `text`
+  // is the message as received.
+  void process_place_orders(server::connection_ptr con, const json &request,
+                            const std::string &text) {
+    // Orders checked but not yet handed to the gateway
+    std::vector<instrument_id> reserved;
+    auto error = [&](const std::string &message) {
+      for (instrument_id id : reserved) {
+        release_order(id);
+      }
+      send_message(
+          con,
+          json{{"type", "place_orders_response"}, {"error", message}}.dump(),
+          websocketpp::frame::opcode::text);
+    };
+    try {
+      if (!request.contains("data") || !request["data"].is_array()) {
+        return error("Invalid request format: 'data' must be an array of "
+                     "orders");
+      }
+      const json &orders = request["data"];
+      if (orders.empty() || orders.size() > max_batch_size) {
+        return error("A batch holds 1 to " + std::to_string(max_batch_size) +
+                     " orders");
+      }
+      if (m_kill_switch) {
+        return error(kill_switch_engaged);
+      }
+      std::string inexact = inexact_number(text);
+      if (!inexact.empty()) {
+        return error(inexact_error(inexact));
+      }
+
+      // Everything is checked before anything is sent, so an exception here
+      // fails the batch as a whole
+      reserved.assign(orders.size(), no_instrument);
+      json results = json::array();
+      json client_order_ids = json::array();
+      size_t outstanding = 0;
+      for (size_t i = 0; i < orders.size(); ++i) {
+        std::string invalid = check_order(orders[i], reserved[i]);
+        if (invalid.empty()) {
+          client_order_ids.push_back(m_client_order_ids.next());
+          results.push_back(nullptr);
+          ++outstanding;
         } else {
-          return R"({"type": "order_response", "error": "Failed to process order: )" +
-                 res->body + R"("})";
+          client_order_ids.push_back(nullptr);
+          results.push_back({{"error", invalid}});
         }
-      } else {
-        return R"({"type": "order_response", "error": "No response from Deribit API"})";
+      }
+
+      auto batch = std::make_shared<batch_reply>("place_orders_response",
+                                                 std::move(results),
+                                                 outstanding);
+      if (outstanding == 0) {
+        send_message(con, batch->dump(), websocketpp::frame::opcode::text);
+        return;
+      }
+      send_message(con,
+                   json{{"type", "place_orders_ack"},
+                        {"client_order_ids", client_order_ids}}
+                       .dump(),
+                   websocketpp::frame::opcode::text);
+
+      httplib::Headers headers = auth_headers();
+      std::string label = con->label;
+      for (size_t i = 0; i < orders.size(); ++i) {
+        if (client_order_ids[i].is_null()) {
+          continue;
+        }
+        std::string client_order_id = client_order_ids[i];
+        uint64_t rpc_id = ++m_rpc_id;
+        json api_request =
+            build_order_request(orders[i], client_order_id, rpc_id, label);
+        submit(con, rpc_id, api_request["method"], headers,
+               api_request.dump(),
+               [this, con, batch, i, client_order_id,
+                id = reserved[i]](const exchange_reply &reply) {
+                 release_order(id);
+                 json result = {{"client_order_id", client_order_id}};
+                 std::string error = order_reply_error(reply);
+                 if (error.empty()) {
+                   json response = json::parse(reply.body, nullptr, false);
+                   result["result"] = response.is_object()
+                                          ? response.value("result", json())
+                                          : json();
+                 } else {
+                   result["error"] = error;
+                 }
+                 finish_batch(con, *batch, i, std::move(result));
+               });
+        reserved[i] = no_instrument;
       }
     } catch (const std::exception &e) {
-      return R"({"type": "order_response", "error": "Error processing order: )" +
-             std::string(e.what()) + R"("})";
+      error(std::string("Error processing orders: ") + e.what());
     }
   }
 
-  std::string process_modify_order(const std::string &payload) {
+  // Cancels every order of a cancel_orders message at once and answers with
+  // a single cancel_orders_response, one result per order in request order
+  void process_cancel_orders(server::connection_ptr con,
+                             const json &request) {
+    auto error = [&](const std::string &message) {
+      send_message(
+          con,
+          json{{"type", "cancel_orders_response"}, {"error", message}}.dump(),
+          websocketpp::frame::opcode::text);
+    };
     try {
-      json request = json::parse(payload);
+      if (!request.contains("data") || !request["data"].contains("order_ids") ||
+          !request["data"]["order_ids"].is_array()) {
+        return error("Invalid request format: 'order_ids' array missing");
+      }
+      const json &order_ids = request["data"]["order_ids"];
+      if (order_ids.empty() || order_ids.size() > max_batch_size) {
+        return error("A batch holds 1 to " + std::to_string(max_batch_size) +
+                     " orders");
+      }
+      for (const auto &order_id : order_ids) {
+        if (!order_id.is_string()) {
+          return error("Order IDs must be strings");
+        }
+      }
+
+      json results = json::array();
+      for (size_t i = 0; i < order_ids.size(); ++i) {
+        results.push_back(nullptr);
+      }
+      auto batch = std::make_shared<batch_reply>(
+          "cancel_orders_response", std::move(results), order_ids.size());
+
+      httplib::Headers headers = auth_headers();
+      for (size_t i = 0; i < order_ids.size(); ++i) {
+        std::string order_id = order_ids[i];
+        uint64_t rpc_id = ++m_rpc_id;
+        json api_request = {{"jsonrpc", "2.0"},
+                            {"id", rpc_id},
+                            {"method", "private/cancel"},
+                            {"params", {{"order_id", order_id}}}};
+        submit(con, rpc_id, "private/cancel", headers, api_request.dump(),
+               [this, con, batch, i, order_id](const exchange_reply &reply) {
+                 json outcome = request_reply(reply);
+                 json result = {{"order_id", order_id}};
+                 if (outcome.contains("error")) {
+                   result["error"] = outcome["error"];
+                 } else {
+                   result["result"] = outcome.value("result", json());
+                 }
+                 finish_batch(con, *batch, i, std::move(result));
+               });
+      }
+    } catch (const std::exception &e) {
+      error(std::string("Error processing cancel orders: ") + e.what());
+    }
+  }
 
+  // Fills in one part of a batch. The response goes out, followed by one
+  // open orders update for the whole batch, with the last part.
+  void finish_batch(server::connection_ptr con, batch_reply &batch,
+                    size_t index, json result) {
+    if (batch.set(index, std::move(result))) {
+      send_message(con, batch.dump(), websocketpp::frame::opcode::text);
+      request_open_orders_update();
+    }
+  }
+
+  void process_modify_order(server::connection_ptr con,
+                            const json &request) {
+    auto error = [&](const std::string &message) {
+      send_message(
+          con,
+          json{{"type", "modify_response"}, {"error", message}}.dump(),
+          websocketpp::frame::opcode::text);
+    };
+    try {
       if (!request.contains("data")) {
-        return json{{"type", "modify_response"},
-                    {"error", "Invalid request format: 'data' field missing"}}
-            .dump();
+        return error("Invalid request format: 'data' field missing");
       }
 
-      json orderData = request["data"];
+      const json &orderData = request["data"];
 
       // Check for required fields
       std::vector<std::string> requiredFields = {"order_id", "amount"};
       for (const auto &field : requiredFields) {
         if (!orderData.contains(field)) {
-          return json{{"type", "modify_response"},
-                      {"error", "Missing required field: " + field}}
-              .dump();
+          return error("Missing required field: " + field);
         }
       }
 
-      std::string access_token = get_access_token();
-
-      static httplib::SSLClient cli("test.deribit.com");
-      cli.set_connection_timeout(5);
-      cli.set_read_timeout(5);
-
-      json api_request = {{"jsonrpc", "2.0"},
-                          {"id", 123},
-                          {"method", "private/edit"},
-                          {"params",
-                           {{"order_id", orderData["order_id"]},
-                            {"amount", orderData["amount"]}}}};
+      json params = {{"order_id", orderData["order_id"]},
+                     {"amount", orderData["amount"]}};
 
       // Add optional parameters if present
       if (orderData.contains("price")) {
-        api_request["params"]["price"] = orderData["price"];
+        params["price"] = orderData["price"];
       }
       if (orderData.contains("post_only")) {
-        api_request["params"]["post_only"] = orderData["post_only"];
+        params["post_only"] = orderData["post_only"];
       }
       if (orderData.contains("reduce_only")) {
-        api_request["params"]["reduce_only"] = orderData["reduce_only"];
+        params["reduce_only"] = orderData["reduce_only"];
       }
 
-      httplib::Headers headers = {{"Authorization", "Bearer " + access_token}};
-
-      auto res = cli.Post("/api/v2/private/edit", headers, api_request.dump(),
-                          "application/json");
+      submit_order_request(con, "private/edit", std::move(params),
+                           "modify_response", "Error processing modify order: ");
+    } catch (const std::exception &e) {
+      error(std::string("Error processing modify order: ") + e.what());
+    }
+  }
 
-      if (res && res->status == 200) {
-        json response = json::parse(res->body);
-        response["type"] = "modify_response";
-        return response.dump();
-      } else {
-        std::string error_msg =
-            res ? "HTTP Error: " + std::to_string(res->status)
-                : "Failed to send request";
-        return json{{"type", "modify_response"}, {"error", error_msg}}.dump();
+  void process_cancel_order(server::connection_ptr con,
+                            const json &request) {
+    auto error = [&](const std::string &message) {
+      send_message(
+          con,
+          json{{"type", "cancel_response"}, {"error", message}}.dump(),
+          websocketpp::frame::opcode::text);
+    };
+    try {
+      if (!request.contains("data") || !request["data"].contains("order_id")) {
+        return error("Invalid request format: 'order_id' field missing");
       }
+
+      std::string order_id = request["data"]["order_id"];
+
+      submit_order_request(con, "private/cancel", {{"order_id", order_id}},
+                           "cancel_response", "Error processing cancel order: ");
     } catch (const std::exception &e) {
-      return json{
-          {"type", "modify_response"},
-          {"error", std::string("Error processing modify order: ") + e.what()}}
-          .dump();
+      error(std::string("Error processing cancel order: ") + e.what());
     }
   }
 
-  std::string process_cancel_order(const std::string &payload) {
+  // Cancels all of one instrument's open orders, optionally only those of
+  // one "type" (limit, stop, ...), in a single exchange call. The result is
+  // the number cancelled.
+  void process_cancel_all_by_instrument(server::connection_ptr con,
+                                        const json &request) {
+    auto error = [&](const std::string &message) {
+      send_message(con,
+                   json{{"type", "cancel_all_by_instrument_response"},
+                        {"error", message}}
+                       .dump(),
+                   websocketpp::frame::opcode::text);
+    };
     try {
-      json request = json::parse(payload);
+      if (!request.contains("data") ||
+          !request["data"].contains("instrument_name")) {
+        return error(
+            "Invalid request format: 'instrument_name' field missing");
+      }
+      const json &data = request["data"];
 
-      if (!request.contains("data") || !request["data"].contains("order_id")) {
-        return json{
-            {"type", "cancel_response"},
-            {"error", "Invalid request format: 'order_id' field missing"}}
-            .dump();
+      json params = {{"instrument_name", data["instrument_name"]}};
+      if (data.contains("type")) {
+        params["type"] = data["type"];
       }
+      submit_order_request(con, "private/cancel_all_by_instrument",
+                           std::move(params),
+                           "cancel_all_by_instrument_response",
+                           "Error processing cancel all: ");
+    } catch (const std::exception &e) {
+      error(std::string("Error processing cancel all: ") + e.what());
+    }
+  }
 
-      std::string order_id = request["data"]["order_id"];
+  // Turns cancel-on-disconnect on or off for this connection. While it is
+  // on, closing the connection cancels every order placed from it since it
+  // was first turned on. Those orders carry the session label rather than
+  // their client order ID as their exchange label.
+  void process_cancel_on_disconnect(server::connection_ptr con,
+                                    const json &request) {
+    json response = {{"type", "cancel_on_disconnect_response"}};
+    if (!request.contains("data") || !request["data"].contains("enabled") ||
+        !request["data"]["enabled"].is_boolean()) {
+      response["error"] = "Invalid request format: 'enabled' field missing";
+    } else {
+      bool enabled = request["data"]["enabled"];
+      if (enabled && con->label.empty()) {
+        con->label = m_session_labels.next();
+      }
+      con->cancel_on_disconnect = enabled;
+      response["enabled"] = enabled;
+    }
+    send_message(con, response.dump(), websocketpp::frame::opcode::text);
+  }
 
-      std::string access_token = get_access_token();
+  // Engages the kill switch: new orders from every connection are refused,
+  // orders not yet sent are withdrawn and every open order on the account,
+  // whichever connection placed it, is cancelled. The switch stays engaged,
+  // even if the cancel fails, until a kill_switch with "data": {"engaged":
+  // false} disengages it.
+  void process_kill_switch(server::connection_ptr con, const json &request) {
+    if (request.contains("data") && request["data"].contains("engaged") &&
+        request["data"]["engaged"] == false) {
+      m_kill_switch = false;
+      send_message(con,
+                   json{{"type", "kill_switch_response"}, {"engaged", false}}
+                       .dump(),
+                   websocketpp::frame::opcode::text);
+      return;
+    }
+    auto triggered = std::chrono::steady_clock::now();
+    m_kill_switch = true;
+    m_gateway.withdraw(nullptr);
+    try {
+      mass_cancel(con, "private/cancel_all", json::object(), triggered,
+                  [this, con](const exchange_reply &reply) {
+                    json response = request_reply(reply);
+                    response["type"] = "kill_switch_response";
+                    response["engaged"] = true;
+                    send_message(con, response.dump(),
+                                 websocketpp::frame::opcode::text);
+                  });
+    } catch (const std::exception &e) {
+      json response = {
+          {"type", "kill_switch_response"},
+          {"engaged", true},
+          {"error", std::string("Error processing kill switch: ") + e.what()}};
+      send_message(con, response.dump(), websocketpp::frame::opcode::text);
+    }
+  }
 
-      static httplib::SSLClient cli("test.deribit.com");
-      cli.set_connection_timeout(5);
-      cli.set_read_timeout(5);
+  // Sends a bulk cancel as an urgent gateway request. The time from
+  // `triggered` to the exchange confirming it goes in the mass_cancel
+  // histogram. `done` runs on a gateway thread and is followed by an open
+  // orders update.
+  void mass_cancel(server::connection_ptr con, const std::string &method,
+                   json params, std::chrono::steady_clock::time_point triggered,
+                   order_gateway::reply_handler done) {
+    uint64_t rpc_id = ++m_rpc_id;
+    json api_request = {{"jsonrpc", "2.0"},
+                        {"id", rpc_id},
+                        {"method", method},
+                        {"params", std::move(params)}};
+    submit(
+        con, rpc_id, method, auth_headers(), api_request.dump(),
+        [this, triggered, done](const exchange_reply &reply) {
+          if (reply.status == 200) {
+            m_metrics.observe(metrics::mass_cancel,
+                              std::chrono::steady_clock::now() - triggered);
+          }
+          done(reply);
+          request_open_orders_update();
+        },
+        true);
+  }
 
-      json api_request = {{"jsonrpc", "2.0"},
-                          {"id", 123},
-                          {"method", "private/cancel"},
-                          {"params", {{"order_id", order_id}}}};
+  // Sends an edit or cancel through the gateway. The reply goes to the
+  // client as `response_type` and is followed by an open orders update.
+  void submit_order_request(server::connection_ptr con,
+                            const std::string &method, json params,
+                            const std::string &response_type,
+                            const std::string &error_prefix) {
+    uint64_t rpc_id = ++m_rpc_id;
+    json api_request = {{"jsonrpc", "2.0"},
+                        {"id", rpc_id},
+                        {"method", method},
+                        {"params", std::move(params)}};
+
+    submit(con, rpc_id, method, auth_headers(), api_request.dump(),
+           [this, con, response_type, error_prefix](const exchange_reply &reply) {
+             try {
+               json response = request_reply(reply);
+               response["type"] = response_type;
+               send_message(con, response.dump(),
+                            websocketpp::frame::opcode::text);
+             } catch (const std::exception &e) {
+               send_message(con,
+                            json{{"type", response_type},
+                                 {"error", error_prefix + e.what()}}
+                                .dump(),
+                            websocketpp::frame::opcode::text);
+             }
+             request_open_orders_update();
+           });
+  }
 
-      httplib::Headers headers = {{"Authorization", "Bearer " + access_token}};
+  // An edit or cancel reply as the client sees it: the exchange's JSON-RPC
+  // response, or an object with just an "error"
+  static json request_reply(const exchange_reply &reply) {
+    if (reply.withdrawn) {
+      return {{"error", "Withdrawn by a mass cancel before reaching the "
+                        "exchange"}};
+    } else if (!reply.sent) {
+      return {{"error", reply.timed_out
+                            ? "Timed out before reaching the exchange"
+                            : "Exchange rate limit reached"}};
+    } else if (reply.timed_out) {
+      return {{"error", "Timed out waiting for the exchange"}};
+    } else if (reply.status == 200) {
+      return json::parse(reply.body);
+    }
+    return {{"error", reply.status
+                          ? "HTTP Error: " + std::to_string(reply.status)
+                          : "Failed to send request"}};
+  }
 
-      auto res = cli.Post("/api/v2/private/cancel", headers, api_request.dump(),
-                          "application/json");
+  httplib::Headers auth_headers() {
+    return {{"Authorization", "Bearer " + get_access_token()}};
+  }
 
-      if (res && res->status == 200) {
-        json response = json::parse(res->body);
-        response["type"] = "cancel_response";
-        return response.dump();
-      } else {
-        std::string error_msg =
-            res ? "HTTP Error: " + std::to_string(res->status)
-                : "Failed to send request";
-        return json{{"type", "cancel_response"}, {"error", error_msg}}.dump();
+  // Hands a JSON-RPC request for `method`, made for the client on `con`, to
+  // the gateway. `done` runs on a gateway thread when the exchange replies
+  // or the request times out. Cancels are scheduled behind orders and
+  // edits, unless `urgent`.
+  void submit(server::connection_ptr con, uint64_t rpc_id,
+              const std::string &method, httplib::Headers headers,
+              std::string body, order_gateway::reply_handler done,
+              bool urgent = false) {
+    request_class cls = method.compare(0, 14, "private/cancel") == 0
+                            ? request_class::cancel
+                            : request_class::order;
+    con->in_flight.fetch_add(1, std::memory_order_relaxed);
+    order_gateway::reply_handler handler = [this, con,
+                                            done](const exchange_reply &reply) {
+      con->in_flight.fetch_sub(1, std::memory_order_relaxed);
+      m_metrics.set(metrics::orders_in_flight, m_gateway.in_flight());
+      if (reply.sent) {
+        m_metrics.observe(metrics::order_queue_wait, reply.queued);
       }
-    } catch (const std::exception &e) {
-      return json{
-          {"type", "cancel_response"},
-          {"error", std::string("Error processing cancel order: ") + e.what()}}
-          .dump();
+      if (reply.timed_out) {
+        m_metrics.add(metrics::orders_timed_out);
+      } else if (reply.sent) {
+        m_metrics.observe(metrics::order_rtt, reply.rtt);
+      } else if (!reply.withdrawn) {
+        m_metrics.add(metrics::requests_shed);
+      }
+      try {
+        done(reply);
+      } catch (const std::exception &e) {
+        m_server.get_elog().write(websocketpp::log::elevel::rerror,
+                                  std::string("Exchange reply handler: ") +
+                                      e.what());
+      }
+    };
+    std::string path = "/api/v2/" + method;
+    if (urgent) {
+      m_gateway.submit_urgent(rpc_id, cls, std::move(path), std::move(headers),
+                              std::move(body), std::move(handler));
+    } else {
+      m_gateway.submit(rpc_id, cls, con.get(), std::move(path),
+                       std::move(headers), std::move(body), std::move(handler));
     }
+    m_metrics.set(metrics::orders_in_flight, m_gateway.in_flight());
   }
 
   void orderbook_update_loop() {
@@ -406,12 +1203,6 @@ private:
         "/api/v2/public/get_order_book?instrument_name=";
     const std::string depth_str = "&depth=" + std::to_string(depth);
 
-    // Initialize update template
-    update_template = {{"type", "orderbook_update"},
-                       {"instrument", ""},
-                       {"timestamp", 0},
-                       {"data", nullptr}};
-
     while (!m_done) {
       try {
         auto now = std::chrono::steady_clock::now();
@@ -430,7 +1221,19 @@ private:
         auto cycle_start = std::chrono::system_clock::now();
         auto timestamp = cycle_start.time_since_epoch().count();
 
-        for (const auto &instrument : m_supported_instruments) {
+        auto instruments = m_instruments.ids("BTC", "future");
+        if (!instruments) {
+          last_update = now;
+          continue;
+        }
+
+        for (instrument_id id : *instruments) {
+          if (!m_scheduler.try_acquire(request_class::market_data)) {
+            // This book goes stale until there are credits again
+            m_metrics.add(metrics::requests_shed);
+            continue;
+          }
+          const std::string &instrument = m_instruments.name(id);
           try {
             // Construct path using pre-allocated buffer
             path_buffer.clear();
@@ -438,7 +1241,11 @@ private:
             path_buffer += instrument;
             path_buffer += depth_str;
 
+            auto poll_start = std::chrono::steady_clock::now();
             auto res = m_http_client.Get(path_buffer.c_str());
+            auto recv_wall = std::chrono::system_clock::now();
+            auto recv_mono = std::chrono::steady_clock::now();
+            m_metrics.observe(metrics::poll_rtt, recv_mono - poll_start);
 
             if (res && res->status == 200) {
               // Quick validation
@@ -446,33 +1253,131 @@ private:
                 continue;
 
               json orderbook = json::parse(res->body);
+              m_metrics.observe(metrics::orderbook_parse,
+                                std::chrono::steady_clock::now() - recv_mono);
 
               if (!orderbook.contains("error") &&
                   orderbook.contains("result")) {
-                update_template["instrument"] = instrument;
-                update_template["timestamp"] = timestamp;
-                update_template["data"] = std::move(orderbook["result"]);
-
-                // Use pre-allocated buffer for serialization
-                response_buffer.clear();
-                auto json_str = update_template.dump();
-                broadcast(json_str);
+                if (m_journal &&
+                    !m_journal->append(instrument, orderbook["result"],
+                                       nanoseconds(recv_wall),
+                                       nanoseconds(recv_mono))) {
+                  m_metrics.add(metrics::journal_dropped);
+                }
+                publish_orderbook(id, orderbook["result"], timestamp,
+                                  recv_wall, recv_mono);
               }
             }
           } catch (const std::exception &e) {
-            std::cerr << "Error processing " << instrument << ": " << e.what()
-                      << '\n';
+            m_server.get_elog().write(websocketpp::log::elevel::rerror,
+                                      "Error processing " + instrument + ": " +
+                                          e.what());
           }
         }
 
         last_update = now;
       } catch (const std::exception &e) {
-        std::cerr << "Error in update loop: " << e.what() << '\n';
+        m_server.get_elog().write(websocketpp::log::elevel::rerror,
+                                  std::string("Error in update loop: ") +
+                                      e.what());
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
       }
     }
   }
 
+  // Sends one book to every client as an orderbook_update. Returns the
+  // largest send backlog of any connection.
+  size_t publish_orderbook(instrument_id id, json &book, int64_t timestamp,
+                           std::chrono::system_clock::time_point recv_wall,
+                           std::chrono::steady_clock::time_point recv_mono) {
+    if (id >= update_templates.size()) {
+      update_templates.resize(id + 1);
+    }
+    json &update_template = update_templates[id];
+    if (update_template.is_null()) {
+      update_template = orderbook_update_template();
+      update_template["instrument"] = m_instruments.name(id);
+    }
+    update_template["timestamp"] = timestamp;
+
+    // Stamps for splitting client latency into exchange->server, time spent
+    // in the server and server->client. Wall clock is needed to compare
+    // against the exchange; the monotonic pair is only comparable with
+    // clients on this host. The send stamp is taken before serialization,
+    // so dump() is charged to server->client.
+    m_risk.on_book(id, book);
+    json &stamps = update_template["latency"];
+    stamps["exchange_ms"] = book.value("timestamp", int64_t(0));
+    stamps["recv_wall_ns"] = nanoseconds(recv_wall);
+    stamps["recv_mono_ns"] = nanoseconds(recv_mono);
+    update_template["data"] = std::move(book);
+    stamps["send_wall_ns"] = nanoseconds(std::chrono::system_clock::now());
+    stamps["send_mono_ns"] = nanoseconds(std::chrono::steady_clock::now());
+
+    // Use pre-allocated buffer for serialization
+    response_buffer.clear();
+    auto json_str = update_template.dump();
+    return broadcast(json_str);
+  }
+
+  // Feeds recorded updates through the same path as polled ones. Replay
+  // starts once a client connects, so every run sees the whole recording.
+  // Receive stamps are the replay times; exchange_ms is as recorded, so
+  // exchange->server latency means nothing here.
+  void replay_loop() {
+    // At full speed, stop when a client is this far behind rather than
+    // queueing without bound. Throughput is then what clients can take.
+    const size_t max_backlog = 4 << 20;
+    size_t backlog = 0;
+
+    while (!m_done && m_connections.empty()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    replay_update update;
+    try {
+      while (!m_done) {
+        while (!m_done && backlog > max_backlog) {
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+          backlog = send_backlog();
+        }
+        if (!m_replay->next(update)) {
+          break;
+        }
+        instrument_id id = m_instruments.intern(update.instrument);
+        if (id == no_instrument) {
+          continue; // instrument table full
+        }
+        auto recv_wall = std::chrono::system_clock::now();
+        auto recv_mono = std::chrono::steady_clock::now();
+        backlog = publish_orderbook(id, update.book,
+                                    recv_wall.time_since_epoch().count(),
+                                    recv_wall, recv_mono);
+      }
+    } catch (const std::exception &e) {
+      m_server.get_elog().write(websocketpp::log::elevel::rerror,
+                                std::string("Error in replay: ") + e.what());
+    }
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    m_server.get_elog().write(
+        websocketpp::log::elevel::info,
+        "Replayed " + std::to_string(m_replay->position()) + " updates in " +
+            std::to_string(elapsed.count()) + "s");
+  }
+
+  // Largest number of bytes waiting to be sent on any one connection
+  size_t send_backlog() {
+    size_t max_queued = 0;
+    std::lock_guard<std::mutex> lock(m_connections_mutex);
+    for (const auto &con : m_connections) {
+      max_queued = std::max(max_queued, con->get_buffered_amount());
+    }
+    return max_queued;
+  }
+
   void positions_update_loop() {
     while (!m_done) {
       std::string access_token = get_access_token();
@@ -482,7 +1387,11 @@ private:
 
       for (const auto &currency : currencies) {
         for (const auto &kind : kinds) {
-          static httplib::SSLClient cli("test.deribit.com");
+          if (!m_scheduler.try_acquire(request_class::account)) {
+            m_metrics.add(metrics::requests_shed);
+            continue;
+          }
+          static httplib::Client cli(exchange_url());
           cli.set_connection_timeout(5);
           cli.set_read_timeout(1);
 
@@ -517,23 +1426,58 @@ private:
     }
   }
 
+  // Broadcasts open orders every 10 seconds, and as soon as an order, edit
+  // or cancel completes. Requests that arrive during a fetch are served by
+  // one more fetch, however many there were.
   void open_orders_update_loop() {
     while (!m_done) {
-      std::string open_orders = get_open_orders();
-
-      json update = {{"type", "open_orders_update"},
-                     {"data", json::parse(open_orders)}};
+      std::vector<traced_order> traced;
+      {
+        std::unique_lock<std::mutex> lock(m_open_orders_mutex);
+        m_open_orders_wanted.wait_for(lock, std::chrono::seconds(10),
+                                      [this] { return m_open_orders_due; });
+        m_open_orders_due = false;
+        traced.swap(m_awaiting_open_orders);
+      }
+      try {
+        broadcast_open_orders_update();
+      } catch (const std::exception &e) {
+        m_server.get_elog().write(websocketpp::log::elevel::warn,
+                                  std::string("Open orders update failed: ") +
+                                      e.what());
+      }
+      for (auto &t : traced) {
+        t.trace.mark(order_trace::open_orders_update);
+        record_trace(t.order, t.client_order_id, t.trace);
+      }
+    }
+  }
 
-      broadcast(update.dump());
+  // Asks the open orders loop for an update now. Gateway replies call this
+  // rather than fetch the open orders themselves, so a reply never waits on
+  // another round trip.
+  void request_open_orders_update() {
+    {
+      std::lock_guard<std::mutex> lock(m_open_orders_mutex);
+      m_open_orders_due = true;
+    }
+    m_open_orders_wanted.notify_one();
+  }
 
-      std::this_thread::sleep_for(std::chrono::seconds(10));
+  // As above; the order's trace is recorded once the update has gone out
+  void request_open_orders_update(traced_order order) {
+    {
+      std::lock_guard<std::mutex> lock(m_open_orders_mutex);
+      m_open_orders_due = true;
+      m_awaiting_open_orders.push_back(std::move(order));
     }
+    m_open_orders_wanted.notify_one();
   }
 
   std::string get_open_orders() {
     std::string access_token = get_access_token();
 
-    static httplib::SSLClient cli("test.deribit.com");
+    static httplib::Client cli(exchange_url());
     cli.set_connection_timeout(5);
     cli.set_read_timeout(5);
 
@@ -556,22 +1500,125 @@ private:
     }
   }
 
+  void record_trace(const json &order, const std::string &client_order_id,
+                    const order_trace &trace) {
+    if (!m_trace_log) {
+      return;
+    }
+    const json &data = order.contains("data") ? order["data"] : json::object();
+    json line = {{"trace_id", ++m_trace_id},
+                 {"client_order_id", client_order_id},
+                 {"instrument_name", data.value("instrument_name", "")},
+                 {"direction", data.value("direction", "")},
+                 {"stages_us", trace.to_json()}};
+    m_trace_log->write(line.dump());
+  }
+
+  // Also refreshes the open order counts the pre-trade checks limit. Skipped
+  // when the scheduler has no credits for it; the next request or the
+  // periodic update catches up.
   void broadcast_open_orders_update() {
-    std::string open_orders = get_open_orders();
+    if (!m_scheduler.try_acquire(request_class::account)) {
+      m_metrics.add(metrics::requests_shed);
+      return;
+    }
+    json open_orders = json::parse(get_open_orders());
+    if (open_orders.contains("result")) {
+      // get_open_orders() asks for BTC only
+      m_risk.set_open_orders("BTC", open_orders["result"]);
+    }
     json update = {{"type", "open_orders_update"},
-                   {"data", json::parse(open_orders)}};
+                   {"data", std::move(open_orders)}};
     broadcast(update.dump());
   }
 
-  void broadcast(const std::string &message) {
+  // Frame `payload` for a single connection, compressed if it negotiated
+  // permessage-deflate. Never goes through the connection's own deflate
+  // stream, whose context takeover would not know about shared frames.
+  void send_message(const server::connection_ptr &con,
+                    const std::string &payload,
+                    websocketpp::frame::opcode::value op) {
+    server::message_ptr frame;
+    if (con->deflate) {
+      frame = make_deflated_frame(payload, op);
+    }
+    if (!frame) {
+      frame = make_prepared_frame<server_config::message_type>(payload, op,
+                                                               false);
+    }
+    // Replies from the gateway can outlive the client that asked
+    if (con->send(frame)) {
+      return;
+    }
+    con->messages_sent.fetch_add(1, std::memory_order_relaxed);
+    m_metrics.add(metrics::messages_sent);
+    m_metrics.add(metrics::bytes_sent, payload.size());
+  }
+
+  server::message_ptr
+  make_deflated_frame(const std::string &payload,
+                      websocketpp::frame::opcode::value op) {
+    std::string compressed;
+    if (payload.size() < server_config::deflate_min_payload ||
+        !m_compressor.compress(payload, compressed)) {
+      return nullptr;
+    }
+    return make_prepared_frame<server_config::message_type>(
+        std::move(compressed), op, true);
+  }
+
+  // Frame the message once, deflate it at most once, and hand the same
+  // frames to every connection. Returns the largest per-connection backlog
+  // seen before sending.
+  size_t broadcast(const std::string &message) {
+    const auto op = websocketpp::frame::opcode::text;
+    server::message_ptr plain;
+    server::message_ptr deflated;
+    bool deflate_tried = false;
+    auto start = std::chrono::steady_clock::now();
+    size_t queued = 0;
+    size_t max_queued = 0;
+    uint64_t sent = 0;
+
     std::lock_guard<std::mutex> lock(m_connections_mutex);
-    for (auto it : m_connections) {
-      m_server.send(it, message, websocketpp::frame::opcode::text);
+    for (const auto &con : m_connections) {
+      server::message_ptr frame;
+      if (con->deflate) {
+        if (!deflate_tried) {
+          deflated = make_deflated_frame(message, op);
+          deflate_tried = true;
+        }
+        frame = deflated;
+      }
+      if (!frame) {
+        if (!plain) {
+          plain = make_prepared_frame<server_config::message_type>(
+              message, op, false);
+        }
+        frame = plain;
+      }
+
+      // Backlog from earlier sends, i.e. how far this client is behind
+      size_t buffered = con->get_buffered_amount();
+      queued += buffered;
+      max_queued = std::max(max_queued, buffered);
+      if (!con->send(frame)) {
+        con->messages_sent.fetch_add(1, std::memory_order_relaxed);
+        ++sent;
+      }
     }
+
+    m_metrics.observe(metrics::broadcast_fanout,
+                      std::chrono::steady_clock::now() - start);
+    m_metrics.add(metrics::messages_sent, sent);
+    m_metrics.add(metrics::bytes_sent, sent * message.size());
+    m_metrics.set(metrics::send_queue_bytes, queued);
+    m_metrics.set(metrics::send_queue_max_bytes, max_queued);
+    return max_queued;
   }
 
   std::string fetch_orderbook(const std::string &instrument, int depth) {
-    static httplib::SSLClient cli("test.deribit.com");
+    static httplib::Client cli(exchange_url());
     cli.set_connection_timeout(5);
     cli.set_read_timeout(1);
 
@@ -594,16 +1641,74 @@ private:
   }
 
   server m_server;
+  broadcast_compressor m_compressor{server_config::deflate_window_bits,
+                                    server_config::deflate_level,
+                                    server_config::deflate_mem_level};
   con_list m_connections;
   std::mutex m_connections_mutex;
   std::atomic<bool> m_done{false};
-  std::vector<std::string> m_supported_instruments;
+  metrics m_metrics;
+  httplib::Server m_metrics_http;
+  std::ofstream m_trace_file;
+  // One JSON line per order with its stage timings, written off the order
+  // path
+  std::unique_ptr<line_writer> m_trace_log;
+  std::atomic<uint64_t> m_trace_id{0};
+  client_order_ids m_client_order_ids;
+  client_order_ids m_session_labels{'s'};
+  std::atomic<uint64_t> m_rpc_id{0};
+  std::unique_ptr<market_journal> m_journal;
+  std::unique_ptr<market_replay> m_replay;
+  instrument_registry m_instruments{instrument_snapshot_path(),
+                                    exchange_url()};
+  // Clients waiting on an instrument list the registry doesn't have yet
+  std::map<std::pair<std::string, std::string>,
+           std::vector<server::connection_ptr>>
+      m_instrument_requests;
+  std::mutex m_instrument_requests_mutex;
+  std::condition_variable m_instruments_wanted;
+  pre_trade_risk m_risk{m_instruments};
+  // Set by a kill switch until a client disengages it; new orders are
+  // refused meanwhile. I/O thread only.
+  bool m_kill_switch = false;
+  std::mutex m_open_orders_mutex;
+  std::condition_variable m_open_orders_wanted;
+  bool m_open_orders_due = false;
+  std::vector<traced_order> m_awaiting_open_orders;
+  request_scheduler m_scheduler;
+  // Last, so it is stopped before anything its handlers use is destroyed
+  order_gateway m_gateway{exchange_url(), order_workers(), order_timeout(),
+                          m_scheduler};
 };
 
+// Every client holds a socket. The default soft limit (256 on macOS, 1024 on
+// most Linux distributions) caps how many dashboards can connect.
+static void raise_fd_limit() {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return;
+  }
+  rlim_t wanted = limit.rlim_max == RLIM_INFINITY ? 65536 : limit.rlim_max;
+  if (limit.rlim_cur >= wanted) {
+    return;
+  }
+  limit.rlim_cur = wanted;
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    // macOS refuses anything above OPEN_MAX even with an unlimited hard cap
+    limit.rlim_cur = 10240;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
 int main() {
+  raise_fd_limit();
   try {
     websocket_server server;
-    std::cout << "Server started at PORT 9002";
+    std::cout << "Server started at PORT 9002 using " << exchange_url();
+    if (replay_source()) {
+      std::cout << ", replaying " << replay_source();
+    }
+    std::cout << std::endl;
     server.run(9002);
   } catch (const std::exception &e) {
     std::cerr << "Fatal error: " << e.what() << std::endl;
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "async_logger.hpp"
+#include "session.hpp"
+#include <cstddef>
+#include <websocketpp/config/asio_no_tls.hpp>
+#include <websocketpp/extensions/permessage_deflate/enabled.hpp>
+#include <websocketpp/logger/stub.hpp>
+
+// Endpoint config for the trading server: the bundled asio config with
+// permessage-deflate negotiated on every connection that offers it, and a
+// session carried by every connection.
+struct server_config : public websocketpp::config::asio {
+  typedef server_config type;
+  typedef websocketpp::config::asio base;
+
+  // The access log is compiled out: every frame and handshake would otherwise
+  // take the logger mutex and format a line on the I/O thread. Errors go to a
+  // ring drained by a background thread so they never block the caller.
+  typedef websocketpp::log::stub alog_type;
+  typedef async_logger<websocketpp::log::elevel> elog_type;
+
+  static const websocketpp::log::level alog_level =
+      websocketpp::log::alevel::none;
+  static const websocketpp::log::level elog_level =
+      websocketpp::log::elevel::info | websocketpp::log::elevel::warn |
+      websocketpp::log::elevel::rerror | websocketpp::log::elevel::fatal;
+
+  typedef session connection_base;
+
+  struct transport_config : public base::transport_config {
+    typedef type::alog_type alog_type;
+    typedef type::elog_type elog_type;
+  };
+
+  typedef websocketpp::transport::asio::endpoint<transport_config>
+      transport_type;
+
+  struct permessage_deflate_config {};
+
+  typedef websocketpp::extensions::permessage_deflate::enabled<
+      permessage_deflate_config>
+      permessage_deflate_type;
+
+  // Outgoing frames are deflated once by broadcast_compressor and shared by
+  // all subscribers instead of going through each connection's own deflate
+  // stream. Connections that negotiated a smaller server_max_window_bits than
+  // deflate_window_bits receive uncompressed frames.
+  static const int deflate_window_bits = 15;
+  static const int deflate_level = 1;
+  static const int deflate_mem_level = 8;
+
+  // Payloads smaller than this are not worth the CPU.
+  static const size_t deflate_min_payload = 256;
+};
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Per-client state. It is the connection_base of every connection (see
+// server_config), so code holding a connection_ptr reads it as a member of
+// the connection, with no lookup by handle.
+//
+// The plain fields are only written on the I/O thread; deflate is set in
+// the open handler, before the connection is visible to other threads.
+// Counters are updated from the broadcast and gateway threads too.
+struct session {
+  // Negotiated permessage-deflate with a window our compressor can target
+  bool deflate = false;
+
+  // Put on this client's orders once it first turns on
+  // cancel-on-disconnect, so they can all be cancelled in one call
+  std::string label;
+  bool cancel_on_disconnect = false;
+
+  // Orders, edits and cancels sent for this client and not yet answered
+  std::atomic<uint32_t> in_flight{0};
+  std::atomic<uint64_t> messages_received{0};
+  std::atomic<uint64_t> messages_sent{0};
+};
@@ -0,0 +1,110 @@
+
+/*
+ * Copyright (c) 2014, Peter Thorson. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the WebSocket++ Project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PETER THORSON BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+//#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE read_buffer
+#include <boost/test/unit_test.hpp>
+
+#include <websocketpp/read_buffer.hpp>
+
+using websocketpp::read_buffer::adaptive;
+using websocketpp::read_buffer::slab;
+
+BOOST_AUTO_TEST_CASE( starts_at_min_size ) {
+    adaptive b(1024,16384,8,false);
+    BOOST_CHECK_EQUAL( b.size(), 1024 );
+    BOOST_CHECK( b.data() != NULL );
+}
+
+BOOST_AUTO_TEST_CASE( min_clamped_to_max ) {
+    adaptive b(4096,2048,8,false);
+    BOOST_CHECK_EQUAL( b.size(), 2048 );
+}
+
+BOOST_AUTO_TEST_CASE( grows_when_full ) {
+    adaptive b(1024,4096,8,false);
+
+    b.adapt(1000);
+    BOOST_CHECK_EQUAL( b.size(), 1024 );
+
+    b.adapt(1024);
+    BOOST_CHECK_EQUAL( b.size(), 2048 );
+
+    b.adapt(2048);
+    BOOST_CHECK_EQUAL( b.size(), 4096 );
+
+    // capped at max
+    b.adapt(4096);
+    BOOST_CHECK_EQUAL( b.size(), 4096 );
+}
+
+BOOST_AUTO_TEST_CASE( shrinks_after_light_reads ) {
+    adaptive b(1024,4096,3,false);
+    b.adapt(1024);
+    b.adapt(2048);
+    BOOST_REQUIRE_EQUAL( b.size(), 4096 );
+
+    b.adapt(100);
+    b.adapt(100);
+    BOOST_CHECK_EQUAL( b.size(), 4096 );
+    b.adapt(100);
+    BOOST_CHECK_EQUAL( b.size(), 2048 );
+
+    // a medium read resets the count
+    b.adapt(100);
+    b.adapt(100);
+    b.adapt(1500);
+    b.adapt(100);
+    b.adapt(100);
+    BOOST_CHECK_EQUAL( b.size(), 2048 );
+    b.adapt(100);
+    BOOST_CHECK_EQUAL( b.size(), 1024 );
+
+    // never below min
+    for (int i = 0; i < 10; i++) {
+        b.adapt(0);
+    }
+    BOOST_CHECK_EQUAL( b.size(), 1024 );
+}
+
+BOOST_AUTO_TEST_CASE( pooled_buffers_are_recycled ) {
+    size_t const size = 12288;
+    size_t cached = slab::get().cached(size);
+
+    {
+        adaptive b(size,size*2,1,true);
+        b.adapt(size);
+        BOOST_CHECK_EQUAL( b.size(), size*2 );
+        BOOST_CHECK_EQUAL( slab::get().cached(size), cached+1 );
+    }
+
+    BOOST_CHECK_EQUAL( slab::get().cached(size*2), 1 );
+
+    char * block = slab::get().acquire(size);
+    BOOST_CHECK_EQUAL( slab::get().cached(size), cached );
+    slab::get().release(block,size);
+}
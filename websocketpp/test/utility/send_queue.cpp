@@ -0,0 +1,238 @@
+
+/*
+ * Copyright (c) 2015, Peter Thorson. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the WebSocket++ Project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PETER THORSON BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+//#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE send_queue
+#include <boost/test/unit_test.hpp>
+
+#include <websocketpp/send_queue.hpp>
+#include <websocketpp/common/thread.hpp>
+#include <websocketpp/common/functional.hpp>
+#include <websocketpp/common/memory.hpp>
+
+#include <vector>
+
+typedef websocketpp::send_queue::mpsc<int> queue_type;
+
+BOOST_AUTO_TEST_CASE( empty_queue ) {
+    queue_type q;
+    int v;
+    BOOST_CHECK( !q.pending() );
+    BOOST_CHECK( !q.pop(v) );
+}
+
+BOOST_AUTO_TEST_CASE( fifo_order ) {
+    queue_type q;
+    int v;
+
+    q.push(1);
+    q.push(2);
+    BOOST_CHECK( q.pending() );
+
+    BOOST_REQUIRE( q.pop(v) );
+    BOOST_CHECK_EQUAL( v, 1 );
+
+    // pushed after the consumer took the first batch
+    q.push(3);
+
+    BOOST_REQUIRE( q.pop(v) );
+    BOOST_CHECK_EQUAL( v, 2 );
+    BOOST_REQUIRE( q.pop(v) );
+    BOOST_CHECK_EQUAL( v, 3 );
+    BOOST_CHECK( !q.pop(v) );
+}
+
+BOOST_AUTO_TEST_CASE( pending_ignores_taken_batch ) {
+    queue_type q;
+    int v;
+
+    q.push(1);
+    q.push(2);
+    BOOST_REQUIRE( q.pop(v) );
+
+    // 2 is now in the consumer's private list
+    BOOST_CHECK( !q.pending() );
+    BOOST_REQUIRE( q.pop(v) );
+    BOOST_CHECK_EQUAL( v, 2 );
+}
+
+BOOST_AUTO_TEST_CASE( destroys_unpopped ) {
+    websocketpp::lib::shared_ptr<int> p = websocketpp::lib::make_shared<int>(5);
+    {
+        websocketpp::send_queue::mpsc<websocketpp::lib::shared_ptr<int> > q;
+        q.push(p);
+        q.push(p);
+        websocketpp::lib::shared_ptr<int> out;
+        BOOST_REQUIRE( q.pop(out) );
+        BOOST_CHECK_EQUAL( p.use_count(), 3 );
+    }
+    BOOST_CHECK_EQUAL( p.use_count(), 1 );
+}
+
+static void produce(queue_type * q, int id, int count) {
+    for (int i = 0; i < count; i++) {
+        q->push(id * count + i);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( concurrent_producers ) {
+    int const producers = 4;
+    int const count = 10000;
+
+    queue_type q;
+    std::vector<websocketpp::lib::shared_ptr<websocketpp::lib::thread> > threads;
+    for (int i = 0; i < producers; i++) {
+        threads.push_back(websocketpp::lib::make_shared<websocketpp::lib::thread>(
+            websocketpp::lib::bind(&produce, &q, i, count)));
+    }
+
+    // consume while producing; each producer's values must stay in order
+    std::vector<int> next(producers, 0);
+    int received = 0;
+    int v;
+    while (received < producers * count) {
+        if (q.pop(v)) {
+            int id = v / count;
+            BOOST_REQUIRE_EQUAL( v % count, next[id] );
+            next[id]++;
+            received++;
+        }
+    }
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+    }
+    BOOST_CHECK( !q.pop(v) );
+}
+
+typedef websocketpp::send_queue::ring<int> ring_type;
+
+BOOST_AUTO_TEST_CASE( ring_capacity_rounded_up ) {
+    ring_type r(5);
+    BOOST_CHECK_EQUAL( r.capacity(), 8 );
+}
+
+BOOST_AUTO_TEST_CASE( ring_fifo_across_laps ) {
+    ring_type r(4);
+    int v;
+
+    BOOST_CHECK( !r.pending() );
+    BOOST_CHECK( !r.pop(v) );
+
+    for (int i = 0; i < 20; i++) {
+        int in = i;
+        r.push(in);
+        BOOST_CHECK( r.pending() );
+        BOOST_REQUIRE( r.pop(v) );
+        BOOST_CHECK_EQUAL( v, i );
+    }
+    BOOST_CHECK( !r.pending() );
+}
+
+BOOST_AUTO_TEST_CASE( ring_spills_in_order ) {
+    ring_type r(4);
+    int v;
+
+    for (int i = 0; i < 10; i++) {
+        int in = i;
+        r.push(in);
+    }
+
+    // drain partially, then push again while earlier values are spilled
+    for (int i = 0; i < 6; i++) {
+        BOOST_REQUIRE( r.pop(v) );
+        BOOST_CHECK_EQUAL( v, i );
+    }
+    for (int i = 10; i < 14; i++) {
+        int in = i;
+        r.push(in);
+    }
+    for (int i = 6; i < 14; i++) {
+        BOOST_REQUIRE( r.pop(v) );
+        BOOST_CHECK_EQUAL( v, i );
+    }
+    BOOST_CHECK( !r.pop(v) );
+    BOOST_CHECK( !r.pending() );
+}
+
+BOOST_AUTO_TEST_CASE( ring_moves_ownership ) {
+    websocketpp::lib::shared_ptr<int> p = websocketpp::lib::make_shared<int>(5);
+    {
+        websocketpp::send_queue::ring<websocketpp::lib::shared_ptr<int> > r(2);
+        for (int i = 0; i < 3; i++) {
+            websocketpp::lib::shared_ptr<int> in = p;
+            r.push(in);
+            BOOST_CHECK( !in );
+        }
+        BOOST_CHECK_EQUAL( p.use_count(), 4 );
+
+        websocketpp::lib::shared_ptr<int> out;
+        BOOST_REQUIRE( r.pop(out) );
+        BOOST_CHECK_EQUAL( p.use_count(), 4 );
+        out.reset();
+        BOOST_CHECK_EQUAL( p.use_count(), 3 );
+    }
+    BOOST_CHECK_EQUAL( p.use_count(), 1 );
+}
+
+static void produce_ring(ring_type * r, int id, int count) {
+    for (int i = 0; i < count; i++) {
+        int in = id * count + i;
+        r->push(in);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( ring_concurrent_producers ) {
+    int const producers = 4;
+    int const count = 10000;
+
+    // small enough that producers regularly spill
+    ring_type r(16);
+    std::vector<websocketpp::lib::shared_ptr<websocketpp::lib::thread> > threads;
+    for (int i = 0; i < producers; i++) {
+        threads.push_back(websocketpp::lib::make_shared<websocketpp::lib::thread>(
+            websocketpp::lib::bind(&produce_ring, &r, i, count)));
+    }
+
+    std::vector<int> next(producers, 0);
+    int received = 0;
+    int v;
+    while (received < producers * count) {
+        if (r.pop(v)) {
+            int id = v / count;
+            BOOST_REQUIRE_EQUAL( v % count, next[id] );
+            next[id]++;
+            received++;
+        }
+    }
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+    }
+    BOOST_CHECK( !r.pop(v) );
+    BOOST_CHECK( !r.pending() );
+}
@@ -189,20 +189,41 @@ struct core {
     static const websocketpp::log::level alog_level =
         websocketpp::log::alevel::all ^ websocketpp::log::alevel::devel;
 
-    /// Size of the per-connection read buffer
+    /// Maximum size of the per-connection read buffer
     /**
-     * Each connection has an internal buffer of this size. A larger value will
-     * result in fewer trips through the library and less CPU overhead at the
-     * expense of increased memory usage per connection.
+     * Each connection has an internal read buffer that starts at
+     * `connection_read_buffer_min_size` bytes and doubles, up to this size,
+     * whenever a read fills it. A larger value will result in fewer trips
+     * through the library and less CPU overhead for busy connections. Only
+     * connections that actually receive bursts of data pay for it.
      *
      * If your application primarily deals in very large messages you may want
      * to try setting this value higher.
-     *
-     * If your application has a lot of connections or primarily deals in small
-     * messages you may want to try setting this smaller.
      */
     static const size_t connection_read_buffer_size = 16384;
 
+    /// Initial and minimum size of the per-connection read buffer
+    /**
+     * This is the memory an idle connection holds for reading. If your
+     * application has a lot of connections or primarily deals in small
+     * messages you may want to try setting this smaller.
+     */
+    static const size_t connection_read_buffer_min_size = 1024;
+
+    /// Consecutive light reads before the read buffer is halved
+    /**
+     * A read is light if it used no more than a quarter of the buffer.
+     */
+    static const size_t connection_read_buffer_shrink_reads = 8;
+
+    /// Draw read buffers from a slab shared by all connections
+    /**
+     * When enabled, buffers released by shrinking or closed connections are
+     * cached process wide and reused by other connections rather than being
+     * returned to the system allocator.
+     */
+    static const bool connection_read_buffer_pooled = false;
+
     /// Drop connections immediately on protocol error.
     /**
      * Drop connections on protocol error rather than sending a close frame.
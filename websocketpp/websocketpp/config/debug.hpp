@@ -189,9 +189,18 @@ struct debug_core {
     static const websocketpp::log::level alog_level =
         websocketpp::log::alevel::all;
 
-    ///
+    /// Maximum size of the per-connection read buffer
     static const size_t connection_read_buffer_size = 16384;
 
+    /// Initial and minimum size of the per-connection read buffer
+    static const size_t connection_read_buffer_min_size = 1024;
+
+    /// Consecutive light reads before the read buffer is halved
+    static const size_t connection_read_buffer_shrink_reads = 8;
+
+    /// Draw read buffers from a slab shared by all connections
+    static const bool connection_read_buffer_pooled = false;
+
     /// Drop connections immediately on protocol error.
     /**
      * Drop connections on protocol error rather than sending a close frame.
@@ -31,17 +31,19 @@
 #include <websocketpp/close.hpp>
 #include <websocketpp/error.hpp>
 #include <websocketpp/frame.hpp>
+#include <websocketpp/read_buffer.hpp>
+#include <websocketpp/send_queue.hpp>
 
 #include <websocketpp/logger/levels.hpp>
 #include <websocketpp/processors/processor.hpp>
 #include <websocketpp/transport/base/connection.hpp>
 #include <websocketpp/http/constants.hpp>
 
+#include <websocketpp/common/atomic.hpp>
 #include <websocketpp/common/connection_hdl.hpp>
 #include <websocketpp/common/cpp11.hpp>
 #include <websocketpp/common/functional.hpp>
 
-#include <queue>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -315,6 +317,10 @@ public:
       , m_max_message_size(config::max_message_size)
       , m_state(session::state::connecting)
       , m_internal_state(session::internal_state::USER_INIT)
+      , m_buf(config::connection_read_buffer_min_size,
+              config::connection_read_buffer_size,
+              config::connection_read_buffer_shrink_reads,
+              config::connection_read_buffer_pooled)
       , m_msg_manager(new con_msg_manager_type())
       , m_send_buffer_size(0)
       , m_write_flag(false)
@@ -622,7 +628,7 @@ public:
      * that are presently cancelable without uncleanly ending the websocket
      * connection
      *
-     * This method invokes the m_write_lock mutex
+     * This method does not lock
      *
      * @return The current number of bytes in the outgoing send buffer.
      */
@@ -645,7 +651,7 @@ public:
      * Convenience method to send a message given a payload string and
      * optionally an opcode. Default opcode is utf8 text.
      *
-     * This method locks the m_write_lock mutex
+     * This method locks the m_write_lock mutex while framing the message
      *
      * @param payload The payload string to generated the message with
      *
@@ -660,7 +666,7 @@ public:
      * Convenience method to send a message given a raw array and optionally an
      * opcode. Default opcode is binary.
      *
-     * This method locks the m_write_lock mutex
+     * This method locks the m_write_lock mutex while framing the message
      *
      * @param payload A pointer to the array containing the bytes to send.
      *
@@ -681,7 +687,9 @@ public:
      * Errors are returned via an exception
      * \todo make exception system_error rather than error_code
      *
-     * This method invokes the m_write_lock mutex
+     * Prepared messages are queued without taking any lock. Unprepared
+     * messages are framed and queued under the m_write_lock mutex so that
+     * stateful extensions see them in the order they are sent.
      *
      * @param msg A message_ptr to the message to send.
      */
@@ -750,7 +758,7 @@ public:
      * detectable errors. Feedback will be provided via on_pong or
      * on_pong_timeout callbacks.
      *
-     * Ping locks the m_write_lock mutex
+     * Ping does not lock the write queue
      *
      * @param payload Payload to be used for the ping
      */
@@ -768,7 +776,7 @@ public:
      *
      * There is no feedback from a pong once sent.
      *
-     * Pong locks the m_write_lock mutex
+     * Pong does not lock the write queue
      *
      * @param payload Payload to be used for the pong
      */
@@ -1319,7 +1327,8 @@ public:
     /**
      * \todo unit tests
      *
-     * This method locks the m_write_lock mutex
+     * Must only be called by the holder of the write flag. Releases the flag
+     * if the queue turns out to be empty.
      */
     void write_frame();
 
@@ -1327,7 +1336,7 @@ public:
     /**
      * \todo unit tests
      *
-     * This method locks the m_write_lock mutex
+     * Called with the write flag held; hands it on to write_frame.
      *
      * @param terminate Whether or not to terminate the connection upon
      * completion of this write.
@@ -1434,20 +1443,29 @@ private:
     /**
      * Adds a message to the write queue and updates any associated shared state
      *
-     * Must be called while holding m_write_lock
+     * Safe to call from any thread without locking
      *
      * @todo unit tests
      *
-     * @param msg The message to push
+     * @param msg The message to push. The queue takes over this reference;
+     * msg is reset.
      */
-    void write_push(message_ptr msg);
+    void write_push(message_ptr & msg);
+
+    /// Start a write if no other thread is writing
+    /**
+     * Takes the write flag if it is free and dispatches write_frame. If the
+     * flag is already held the current writer will pick up anything pushed
+     * before this call.
+     */
+    void schedule_write();
 
     /// Pop a message from the write queue
     /**
      * Removes and returns a message from the write queue and updates any
      * associated shared state.
      *
-     * Must be called while holding m_write_lock
+     * Must only be called by the holder of the write flag
      *
      * @todo unit tests
      *
@@ -1519,9 +1537,10 @@ private:
 
     /// External connection state
     /**
-     * Lock: m_connection_state_lock
+     * Lock: m_connection_state_lock for transitions. May be read without the
+     * lock.
      */
-    session::state::value   m_state;
+    lib::atomic<session::state::value> m_state;
 
     /// Internal connection state
     /**
@@ -1531,15 +1550,23 @@ private:
 
     mutable mutex_type      m_connection_state_lock;
 
-    /// The lock used to protect the message queue
+    /// The lock used to protect shared state within the processor
     /**
-     * Serializes access to the write queue as well as shared state within the
-     * processor.
+     * Serializes framing of unprepared outgoing messages along with pushing
+     * them onto the write queue, so that the order in which the processor
+     * saw them is the order in which they are written.
      */
     mutex_type              m_write_lock;
 
     // connection resources
-    char                    m_buf[config::connection_read_buffer_size];
+
+    /// Transport read buffer
+    /**
+     * Sized adaptively between `config::connection_read_buffer_min_size` and
+     * `config::connection_read_buffer_size`. Only resized from
+     * handle_read_frame once the bytes of the previous read are consumed.
+     */
+    read_buffer::adaptive   m_buf;
     size_t                  m_buf_cursor;
     termination_handler     m_termination_handler;
     con_msg_manager_ptr     m_msg_manager;
@@ -1563,19 +1590,16 @@ private:
 
     /// Queue of unsent outgoing messages
     /**
-     * Lock: m_write_lock
+     * Pushed from any thread, drained by the holder of m_write_flag
      */
-    std::queue<message_ptr> m_send_queue;
+    send_queue::ring<message_ptr> m_send_queue;
 
     /// Size in bytes of the outstanding payloads in the write queue
-    /**
-     * Lock: m_write_lock
-     */
-    size_t m_send_buffer_size;
+    lib::atomic<size_t> m_send_buffer_size;
 
     /// buffer holding the various parts of the current message being writen
     /**
-     * Lock m_write_lock
+     * Owned by the holder of m_write_flag
      */
     std::vector<transport::buffer> m_send_buffer;
 
@@ -1583,11 +1607,13 @@ private:
     /// from going out of scope before the write is complete.
     std::vector<message_ptr> m_current_msgs;
 
-    /// True if there is currently an outstanding transport write
+    /// True while a thread owns the write side of the connection
     /**
-     * Lock m_write_lock
+     * Set by whoever wins the exchange in schedule_write and held until the
+     * queue is found empty, so at most one thread drains m_send_queue and
+     * at most one transport write is outstanding.
      */
-    bool m_write_flag;
+    lib::atomic<bool> m_write_flag;
 
     /// True if this connection is presently reading new data
     bool m_read_flag;
@@ -69,14 +69,12 @@ std::string const & connection<config>::get_origin() const {
 
 template <typename config>
 size_t connection<config>::get_buffered_amount() const {
-    //scoped_lock_type lock(m_connection_state_lock);
-    return m_send_buffer_size;
+    return m_send_buffer_size.load(lib::memory_order_relaxed);
 }
 
 template <typename config>
 session::state::value connection<config>::get_state() const {
-    //scoped_lock_type lock(m_connection_state_lock);
-    return m_state;
+    return m_state.load(lib::memory_order_acquire);
 }
 
 template <typename config>
@@ -107,24 +105,17 @@ lib::error_code connection<config>::send(typename config::message_type::ptr msg)
         m_alog->write(log::alevel::devel,"connection send");
     }
 
-    {
-        scoped_lock_type lock(m_connection_state_lock);
-        if (m_state != session::state::open) {
-           return error::make_error_code(error::invalid_state);
-        }
+    // State transitions still happen under m_connection_state_lock. A
+    // transition racing with this check was equally possible once the lock
+    // was released, so reading the atomic is enough here.
+    if (m_state.load(lib::memory_order_acquire) != session::state::open) {
+        return error::make_error_code(error::invalid_state);
     }
 
-    message_ptr outgoing_msg;
-    bool needs_writing = false;
-
     if (msg->get_prepared()) {
-        outgoing_msg = msg;
-
-        scoped_lock_type lock(m_write_lock);
-        write_push(outgoing_msg);
-        needs_writing = !m_write_flag && !m_send_queue.empty();
+        write_push(msg);
     } else {
-        outgoing_msg = m_msg_manager->get_message();
+        message_ptr outgoing_msg = m_msg_manager->get_message();
 
         if (!outgoing_msg) {
             return error::make_error_code(error::no_outgoing_buffers);
@@ -138,15 +129,9 @@ lib::error_code connection<config>::send(typename config::message_type::ptr msg)
         }
 
         write_push(outgoing_msg);
-        needs_writing = !m_write_flag && !m_send_queue.empty();
     }
 
-    if (needs_writing) {
-        transport_con_type::dispatch(lib::bind(
-            &type::write_frame,
-            type::get_shared()
-        ));
-    }
+    schedule_write();
 
     return lib::error_code();
 }
@@ -203,19 +188,8 @@ void connection<config>::ping(std::string const& payload, lib::error_code& ec) {
         }
     }
 
-    bool needs_writing = false;
-    {
-        scoped_lock_type lock(m_write_lock);
-        write_push(msg);
-        needs_writing = !m_write_flag && !m_send_queue.empty();
-    }
-
-    if (needs_writing) {
-        transport_con_type::dispatch(lib::bind(
-            &type::write_frame,
-            type::get_shared()
-        ));
-    }
+    write_push(msg);
+    schedule_write();
 
     ec = lib::error_code();
 }
@@ -274,19 +248,8 @@ void connection<config>::pong(std::string const& payload, lib::error_code& ec) {
     ec = m_processor->prepare_pong(payload,msg);
     if (ec) {return;}
 
-    bool needs_writing = false;
-    {
-        scoped_lock_type lock(m_write_lock);
-        write_push(msg);
-        needs_writing = !m_write_flag && !m_send_queue.empty();
-    }
-
-    if (needs_writing) {
-        transport_con_type::dispatch(lib::bind(
-            &type::write_frame,
-            type::get_shared()
-        ));
-    }
+    write_push(msg);
+    schedule_write();
 
     ec = lib::error_code();
 }
@@ -787,8 +750,8 @@ void connection<config>::read_handshake(size_t num_bytes) {
 
     transport_con_type::async_read_at_least(
         num_bytes,
-        m_buf,
-        config::connection_read_buffer_size,
+        m_buf.data(),
+        m_buf.size(),
         lib::bind(
             &type::handle_read_handshake,
             type::get_shared(),
@@ -841,7 +804,7 @@ void connection<config>::handle_read_handshake(lib::error_code const & ec,
     }
 
     // Boundaries checking. TODO: How much of this should be done?
-    if (bytes_transferred > config::connection_read_buffer_size) {
+    if (bytes_transferred > m_buf.size()) {
         m_elog->write(log::elevel::fatal,"Fatal boundaries checking error.");
         this->terminate(make_error_code(error::general));
         return;
@@ -849,7 +812,7 @@ void connection<config>::handle_read_handshake(lib::error_code const & ec,
 
     size_t bytes_processed = 0;
     try {
-        bytes_processed = m_request.consume(m_buf,bytes_transferred);
+        bytes_processed = m_request.consume(m_buf.data(),bytes_transferred);
     } catch (http::exception &e) {
         // All HTTP exceptions will result in this request failing and an error
         // response being returned. No more bytes will be read in this con.
@@ -886,7 +849,8 @@ void connection<config>::handle_read_handshake(lib::error_code const & ec,
             if (bytes_transferred-bytes_processed >= 8) {
                 m_request.replace_header(
                     "Sec-WebSocket-Key3",
-                    std::string(m_buf+bytes_processed,m_buf+bytes_processed+8)
+                    std::string(m_buf.data()+bytes_processed,
+                        m_buf.data()+bytes_processed+8)
                 );
                 bytes_processed += 8;
             } else {
@@ -909,7 +873,8 @@ void connection<config>::handle_read_handshake(lib::error_code const & ec,
         // The remaining bytes in m_buf are frame data. Copy them to the
         // beginning of the buffer and note the length. They will be read after
         // the handshake completes and before more bytes are read.
-        std::copy(m_buf+bytes_processed,m_buf+bytes_transferred,m_buf);
+        std::copy(m_buf.data()+bytes_processed,m_buf.data()+bytes_transferred,
+            m_buf.data());
         m_buf_cursor = bytes_transferred-bytes_processed;
 
 
@@ -928,8 +893,8 @@ void connection<config>::handle_read_handshake(lib::error_code const & ec,
         // read at least 1 more byte
         transport_con_type::async_read_at_least(
             1,
-            m_buf,
-            config::connection_read_buffer_size,
+            m_buf.data(),
+            m_buf.size(),
             lib::bind(
                 &type::handle_read_handshake,
                 type::get_shared(),
@@ -1015,7 +980,7 @@ void connection<config>::handle_read_frame(lib::error_code const & ec,
     }
 
     // Boundaries checking. TODO: How much of this should be done?
-    /*if (bytes_transferred > config::connection_read_buffer_size) {
+    /*if (bytes_transferred > m_buf.size()) {
         m_elog->write(log::elevel::fatal,"Fatal boundaries checking error");
         this->terminate(make_error_code(error::general));
         return;
@@ -1040,12 +1005,12 @@ void connection<config>::handle_read_frame(lib::error_code const & ec,
 
         if (m_alog->static_test(log::alevel::devel)) {
             std::stringstream s;
-            s << "Processing Bytes: " << utility::to_hex(reinterpret_cast<uint8_t*>(m_buf)+p,bytes_transferred-p);
+            s << "Processing Bytes: " << utility::to_hex(reinterpret_cast<uint8_t*>(m_buf.data())+p,bytes_transferred-p);
             m_alog->write(log::alevel::devel,s.str());
         }
 
         p += m_processor->consume(
-            reinterpret_cast<uint8_t*>(m_buf)+p,
+            reinterpret_cast<uint8_t*>(m_buf.data())+p,
             bytes_transferred-p,
             consume_ec
         );
@@ -1102,6 +1067,10 @@ void connection<config>::handle_read_frame(lib::error_code const & ec,
         }
     }
 
+    // All bytes of this read have been handed to the processor, so the buffer
+    // may be resized before the next read is issued.
+    m_buf.adapt(bytes_transferred);
+
     read_frame();
 }
 
@@ -1118,11 +1087,11 @@ void connection<config>::read_frame() {
         // Need to determine if requesting 1 byte or the exact number of bytes
         // is better here. 1 byte lets us be a bit more responsive at a
         // potential expense of additional runs through handle_read_frame
-        /*(m_processor->get_bytes_needed() > config::connection_read_buffer_size ?
-         config::connection_read_buffer_size : m_processor->get_bytes_needed())*/
+        /*(m_processor->get_bytes_needed() > m_buf.size() ?
+         m_buf.size() : m_processor->get_bytes_needed())*/
         1,
-        m_buf,
-        config::connection_read_buffer_size,
+        m_buf.data(),
+        m_buf.size(),
         m_handle_read_frame
     );
 }
@@ -1531,8 +1500,8 @@ void connection<config>::handle_send_http_request(lib::error_code const & ec) {
 
     transport_con_type::async_read_at_least(
         1,
-        m_buf,
-        config::connection_read_buffer_size,
+        m_buf.data(),
+        m_buf.size(),
         lib::bind(
             &type::handle_read_http_response,
             type::get_shared(),
@@ -1585,7 +1554,7 @@ void connection<config>::handle_read_http_response(lib::error_code const & ec,
     size_t bytes_processed = 0;
     // TODO: refactor this to use error codes rather than exceptions
     try {
-        bytes_processed = m_response.consume(m_buf,bytes_transferred);
+        bytes_processed = m_response.consume(m_buf.data(),bytes_transferred);
     } catch (http::exception & e) {
         m_elog->write(log::elevel::rerror,
             std::string("error in handle_read_http_response: ")+e.what());
@@ -1643,15 +1612,16 @@ void connection<config>::handle_read_http_response(lib::error_code const & ec,
         // The remaining bytes in m_buf are frame data. Copy them to the
         // beginning of the buffer and note the length. They will be read after
         // the handshake completes and before more bytes are read.
-        std::copy(m_buf+bytes_processed,m_buf+bytes_transferred,m_buf);
+        std::copy(m_buf.data()+bytes_processed,m_buf.data()+bytes_transferred,
+            m_buf.data());
         m_buf_cursor = bytes_transferred-bytes_processed;
 
         this->handle_read_frame(lib::error_code(), m_buf_cursor);
     } else {
         transport_con_type::async_read_at_least(
             1,
-            m_buf,
-            config::connection_read_buffer_size,
+            m_buf.data(),
+            m_buf.size(),
             lib::bind(
                 &type::handle_read_http_response,
                 type::get_shared(),
@@ -1793,37 +1763,36 @@ template <typename config>
 void connection<config>::write_frame() {
     //m_alog->write(log::alevel::devel,"connection write_frame");
 
-    {
-        scoped_lock_type lock(m_write_lock);
-
-        // Check the write flag. If true, there is an outstanding transport
-        // write already. In this case we just return. The write handler will
-        // start a new write if the write queue isn't empty. If false, we set
-        // the write flag and proceed to initiate a transport write.
-        if (m_write_flag) {
-            return;
-        }
-
+    // The caller holds the write flag, so this is the only thread draining
+    // the queue and there is no outstanding transport write.
+    for (;;) {
         // pull off all the messages that are ready to write.
         // stop if we get a message marked terminal
         message_ptr next_message = write_pop();
         while (next_message) {
-            m_current_msgs.push_back(next_message);
-            if (!next_message->get_terminal()) {
+            bool terminal = next_message->get_terminal();
+
+            // swap rather than copy to avoid touching the reference count
+            m_current_msgs.push_back(message_ptr());
+            m_current_msgs.back().swap(next_message);
+
+            if (!terminal) {
                 next_message = write_pop();
-            } else {
-                next_message = message_ptr();
             }
         }
-        
-        if (m_current_msgs.empty()) {
-            // there was nothing to send
-            return;
-        } else {
-            // At this point we own the next messages to be sent and are
-            // responsible for holding the write flag until they are 
+
+        if (!m_current_msgs.empty()) {
+            // We keep holding the write flag until these messages are
             // successfully sent or there is some error
-            m_write_flag = true;
+            break;
+        }
+
+        // There was nothing to send. Release the flag, then check for a push
+        // that raced with the release: its schedule_write may have seen the
+        // flag still set and left the message for us.
+        m_write_flag.store(false);
+        if (!m_send_queue.pending() || m_write_flag.exchange(true)) {
+            return;
         }
     }
 
@@ -1909,22 +1878,12 @@ void connection<config>::handle_write_frame(lib::error_code const & ec)
         return;
     }
 
-    bool needs_writing = false;
-    {
-        scoped_lock_type lock(m_write_lock);
-
-        // release write flag
-        m_write_flag = false;
-
-        needs_writing = !m_send_queue.empty();
-    }
-
-    if (needs_writing) {
-        transport_con_type::dispatch(lib::bind(
-            &type::write_frame,
-            type::get_shared()
-        ));
-    }
+    // Still holding the write flag. write_frame either starts the next write
+    // or releases it.
+    transport_con_type::dispatch(lib::bind(
+        &type::write_frame,
+        type::get_shared()
+    ));
 }
 
 template <typename config>
@@ -2140,19 +2099,8 @@ lib::error_code connection<config>::send_close_frame(close::status::value code,
         );
     }
 
-    bool needs_writing = false;
-    {
-        scoped_lock_type lock(m_write_lock);
-        write_push(msg);
-        needs_writing = !m_write_flag && !m_send_queue.empty();
-    }
-
-    if (needs_writing) {
-        transport_con_type::dispatch(lib::bind(
-            &type::write_frame,
-            type::get_shared()
-        ));
-    }
+    write_push(msg);
+    schedule_write();
 
     return lib::error_code();
 }
@@ -2207,41 +2155,54 @@ connection<config>::get_processor(int version) const {
 }
 
 template <typename config>
-void connection<config>::write_push(typename config::message_type::ptr msg)
+void connection<config>::write_push(typename config::message_type::ptr & msg)
 {
     if (!msg) {
         return;
     }
 
-    m_send_buffer_size += msg->get_payload().size();
+    size_t size = msg->get_payload().size();
+    size_t buffered = m_send_buffer_size.fetch_add(size,
+        lib::memory_order_relaxed) + size;
     m_send_queue.push(msg);
 
     if (m_alog->static_test(log::alevel::devel)) {
         std::stringstream s;
-        s << "write_push: message count: " << m_send_queue.size()
-          << " buffer size: " << m_send_buffer_size;
+        s << "write_push: buffer size: " << buffered;
         m_alog->write(log::alevel::devel,s.str());
     }
 }
 
+template <typename config>
+void connection<config>::schedule_write()
+{
+    // Check before exchanging so that senders to a connection that is
+    // already writing do not all contend on the flag's cache line.
+    if (m_write_flag.load() || m_write_flag.exchange(true)) {
+        return;
+    }
+
+    transport_con_type::dispatch(lib::bind(
+        &type::write_frame,
+        type::get_shared()
+    ));
+}
+
 template <typename config>
 typename config::message_type::ptr connection<config>::write_pop()
 {
     message_ptr msg;
 
-    if (m_send_queue.empty()) {
+    if (!m_send_queue.pop(msg)) {
         return msg;
     }
 
-    msg = m_send_queue.front();
-
-    m_send_buffer_size -= msg->get_payload().size();
-    m_send_queue.pop();
+    size_t buffered = m_send_buffer_size.fetch_sub(msg->get_payload().size(),
+        lib::memory_order_relaxed) - msg->get_payload().size();
 
     if (m_alog->static_test(log::alevel::devel)) {
         std::stringstream s;
-        s << "write_pop: message count: " << m_send_queue.size()
-          << " buffer size: " << m_send_buffer_size;
+        s << "write_pop: buffer size: " << buffered;
         m_alog->write(log::alevel::devel,s.str());
     }
     return msg;
@@ -0,0 +1,231 @@
+
+/*
+ * Copyright (c) 2014, Peter Thorson. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the WebSocket++ Project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PETER THORSON BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef WEBSOCKETPP_READ_BUFFER_HPP
+#define WEBSOCKETPP_READ_BUFFER_HPP
+
+#include <websocketpp/common/thread.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace websocketpp {
+/// Per-connection transport read buffers
+namespace read_buffer {
+
+/// Process wide cache of read buffer blocks shared by all connections
+/**
+ * Blocks are cached by exact size. Adaptive buffers only ever request sizes
+ * of the form `min_size * 2^n` (clamped to the maximum) so the number of
+ * distinct sizes, and thus the cost of the linear class lookup, is small.
+ *
+ * Each size class retains at most `max_cached` free blocks. Blocks released
+ * beyond that are returned to the system allocator.
+ */
+class slab {
+public:
+    /// Maximum number of free blocks retained per size class
+    static size_t const max_cached = 256;
+
+    /// Get the process wide slab instance
+    static slab & get() {
+        static slab instance;
+        return instance;
+    }
+
+    ~slab() {
+        for (size_t i = 0; i < m_classes.size(); i++) {
+            for (size_t j = 0; j < m_classes[i].blocks.size(); j++) {
+                delete[] m_classes[i].blocks[j];
+            }
+        }
+    }
+
+    /// Take a block of exactly `size` bytes, reusing a cached one if possible
+    char * acquire(size_t size) {
+        {
+            lib::lock_guard<lib::mutex> lock(m_lock);
+            size_class * c = find(size);
+            if (c && !c->blocks.empty()) {
+                char * block = c->blocks.back();
+                c->blocks.pop_back();
+                return block;
+            }
+        }
+        return new char[size];
+    }
+
+    /// Return a block previously obtained from acquire(size)
+    void release(char * block, size_t size) {
+        {
+            lib::lock_guard<lib::mutex> lock(m_lock);
+            size_class * c = find(size);
+            if (!c) {
+                m_classes.push_back(size_class());
+                c = &m_classes.back();
+                c->size = size;
+            }
+            if (c->blocks.size() < max_cached) {
+                c->blocks.push_back(block);
+                return;
+            }
+        }
+        delete[] block;
+    }
+
+    /// Number of cached free blocks of the given size
+    size_t cached(size_t size) {
+        lib::lock_guard<lib::mutex> lock(m_lock);
+        size_class * c = find(size);
+        return c ? c->blocks.size() : 0;
+    }
+private:
+    struct size_class {
+        size_t size;
+        std::vector<char *> blocks;
+    };
+
+    slab() {}
+    slab(slab const &);
+    slab & operator=(slab const &);
+
+    size_class * find(size_t size) {
+        for (size_t i = 0; i < m_classes.size(); i++) {
+            if (m_classes[i].size == size) {
+                return &m_classes[i];
+            }
+        }
+        return NULL;
+    }
+
+    std::vector<size_class> m_classes;
+    lib::mutex m_lock;
+};
+
+/// A read buffer that grows under load and shrinks when traffic is light
+/**
+ * The buffer starts at `min_size` bytes. When a read fills it completely the
+ * next read is issued with twice the capacity, up to `max_size`. After
+ * `shrink_reads` consecutive reads that used no more than a quarter of the
+ * capacity it is halved again, down to `min_size`.
+ *
+ * Resizing discards the buffer contents, so adapt() must only be called once
+ * all bytes from the previous read have been consumed and before the next
+ * read is issued.
+ */
+class adaptive {
+public:
+    adaptive(size_t min_size, size_t max_size, size_t shrink_reads,
+        bool pooled)
+      : m_data(NULL)
+      , m_size(std::min(min_size, max_size))
+      , m_min_size(std::min(min_size, max_size))
+      , m_max_size(max_size)
+      , m_shrink_reads(shrink_reads)
+      , m_small_reads(0)
+      , m_pooled(pooled)
+    {
+        m_data = allocate(m_size);
+    }
+
+    ~adaptive() {
+        deallocate(m_data, m_size);
+    }
+
+    /// Pointer to the start of the buffer
+    char * data() {
+        return m_data;
+    }
+
+    /// Pointer to the start of the buffer
+    char const * data() const {
+        return m_data;
+    }
+
+    /// Current capacity of the buffer in bytes
+    size_t size() const {
+        return m_size;
+    }
+
+    /// Resize the buffer based on how many bytes the last read delivered
+    /**
+     * @param bytes_read The number of bytes delivered by the last read into
+     * this buffer.
+     */
+    void adapt(size_t bytes_read) {
+        if (bytes_read >= m_size) {
+            m_small_reads = 0;
+            if (m_size < m_max_size) {
+                resize(std::min(m_size * 2, m_max_size));
+            }
+        } else if (bytes_read <= m_size / 4 && m_size > m_min_size) {
+            if (++m_small_reads >= m_shrink_reads) {
+                m_small_reads = 0;
+                resize(std::max(m_size / 2, m_min_size));
+            }
+        } else {
+            m_small_reads = 0;
+        }
+    }
+private:
+    adaptive(adaptive const &);
+    adaptive & operator=(adaptive const &);
+
+    char * allocate(size_t size) {
+        return m_pooled ? slab::get().acquire(size) : new char[size];
+    }
+
+    void deallocate(char * block, size_t size) {
+        if (m_pooled) {
+            slab::get().release(block, size);
+        } else {
+            delete[] block;
+        }
+    }
+
+    void resize(size_t size) {
+        char * block = allocate(size);
+        deallocate(m_data, m_size);
+        m_data = block;
+        m_size = size;
+    }
+
+    char *          m_data;
+    size_t          m_size;
+    size_t const    m_min_size;
+    size_t const    m_max_size;
+    size_t const    m_shrink_reads;
+    size_t          m_small_reads;
+    bool const      m_pooled;
+};
+
+} // namespace read_buffer
+} // namespace websocketpp
+
+#endif // WEBSOCKETPP_READ_BUFFER_HPP
@@ -0,0 +1,319 @@
+
+/*
+ * Copyright (c) 2014, Peter Thorson. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the WebSocket++ Project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PETER THORSON BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef WEBSOCKETPP_SEND_QUEUE_HPP
+#define WEBSOCKETPP_SEND_QUEUE_HPP
+
+#include <websocketpp/common/atomic.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <utility>
+
+namespace websocketpp {
+/// Per-connection outgoing message queues
+namespace send_queue {
+
+/// Unbounded lock-free multi-producer single-consumer queue
+/**
+ * Producers link nodes onto an atomic LIFO stack with a single CAS. The
+ * consumer detaches the whole stack with one exchange and reverses it into
+ * a private FIFO list, so items come out in the order their pushes took
+ * effect and the consumer only touches shared state once per batch.
+ *
+ * push() and pending() may be called from any thread. pop() must only be
+ * called by one thread at a time; the connection guarantees this through its
+ * write flag.
+ */
+template <typename T>
+class mpsc {
+public:
+    mpsc() : m_head(NULL), m_out(NULL) {}
+
+    ~mpsc() {
+        free_list(m_head.load(lib::memory_order_acquire));
+        free_list(m_out);
+    }
+
+    /// Append a value. Safe to call concurrently from any thread.
+    void push(T const & value) {
+        node * n = new node(value);
+        node * head = m_head.load(lib::memory_order_relaxed);
+        do {
+            n->next = head;
+        } while (!m_head.compare_exchange_weak(head, n,
+            lib::memory_order_seq_cst, lib::memory_order_relaxed));
+    }
+
+    /// Remove the oldest value. Consumer only.
+    /**
+     * @param value Receives the popped value.
+     * @return Whether a value was popped.
+     */
+    bool pop(T & value) {
+        if (!m_out) {
+            node * batch = m_head.exchange(NULL, lib::memory_order_acquire);
+            while (batch) {
+                node * next = batch->next;
+                batch->next = m_out;
+                m_out = batch;
+                batch = next;
+            }
+            if (!m_out) {
+                return false;
+            }
+        }
+
+        node * n = m_out;
+        m_out = n->next;
+        using std::swap;
+        swap(value, n->value);
+        delete n;
+        return true;
+    }
+
+    /// Whether producers have pushed values the consumer has not yet taken
+    /**
+     * Only inspects the shared side of the queue, so it may be called from
+     * any thread. Values already moved to the consumer's private list are not
+     * seen; the consumer uses this after draining to detect pushes that raced
+     * with it releasing the write flag.
+     */
+    bool pending() const {
+        return m_head.load(lib::memory_order_seq_cst) != NULL;
+    }
+private:
+    struct node {
+        explicit node(T const & v) : value(v), next(NULL) {}
+        T value;
+        node * next;
+    };
+
+    static void free_list(node * n) {
+        while (n) {
+            node * next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+
+    // Non-copyable
+    mpsc(mpsc const &);
+    mpsc & operator=(mpsc const &);
+
+    lib::atomic<node *> m_head;
+    node * m_out;
+};
+
+/// Fixed-capacity lock-free multi-producer single-consumer ring
+/**
+ * Every push takes a ticket from a shared counter and claims the slot the
+ * ticket maps to. Values are swapped in and out of the slots, so queueing a
+ * shared_ptr costs no reference count traffic beyond what the caller
+ * already paid, and the steady state performs no allocation.
+ *
+ * If a producer finds its slot still holding the value from one lap earlier
+ * the ring is full. The value spills to an mpsc list tagged with its ticket
+ * and the consumer picks it up when it reaches that ticket, so the ring
+ * behaves as if it had grown. Spilling allocates; the ring never resizes.
+ *
+ * The slots are allocated by the first push, so a connection that never
+ * sends anything costs only the ring's bookkeeping. Producers racing on the
+ * first push each build a slot array and all but one discard theirs.
+ *
+ * Values are popped in ticket order, which preserves the order of pushes
+ * made by any one thread. A ticket that has been taken but not yet written
+ * blocks the consumer until its producer finishes the push.
+ *
+ * push() and pending() may be called from any thread. pop() must only be
+ * called by one thread at a time.
+ */
+template <typename T>
+class ring {
+public:
+    /// Number of slots used when no capacity is given
+    static size_t const default_capacity = 64;
+
+    /// Construct a ring
+    /**
+     * @param capacity Number of slots, rounded up to a power of two.
+     */
+    explicit ring(size_t capacity = default_capacity)
+      : m_mask(round_up(capacity) - 1)
+      , m_slots(NULL)
+      , m_tail(0)
+      , m_head(0) {}
+
+    ~ring() {
+        delete[] m_slots.load(lib::memory_order_acquire);
+    }
+
+    /// Number of slots
+    size_t capacity() const {
+        return m_mask + 1;
+    }
+
+    /// Append a value. Safe to call concurrently from any thread.
+    /**
+     * @param value The value to push. Ownership moves into the queue; value
+     * is left default constructed.
+     */
+    void push(T & value) {
+        slot * slots = allocate();
+        size_t ticket = m_tail.fetch_add(1, lib::memory_order_relaxed);
+        slot & s = slots[ticket & m_mask];
+
+        if (s.sequence.load(lib::memory_order_acquire) == ticket) {
+            using std::swap;
+            swap(s.value, value);
+            s.sequence.store(ticket + 1, lib::memory_order_seq_cst);
+        } else {
+            m_overflow.push(std::make_pair(ticket, value));
+            value = T();
+        }
+    }
+
+    /// Remove the oldest value. Consumer only.
+    /**
+     * @param value Receives the popped value.
+     * @return Whether a value was popped.
+     */
+    bool pop(T & value) {
+        // Nothing has been pushed, not even a spilled value, until the
+        // slots exist
+        slot * slots = m_slots.load(lib::memory_order_acquire);
+        if (!slots) {
+            return false;
+        }
+        size_t head = m_head.load(lib::memory_order_relaxed);
+        slot & s = slots[head & m_mask];
+
+        if (s.sequence.load(lib::memory_order_acquire) == head + 1) {
+            using std::swap;
+            swap(value, s.value);
+        } else if (!take_spilled(head, value)) {
+            return false;
+        }
+
+        // Hand the slot to the ticket one lap ahead. This applies even if the
+        // value came from the spill list and the slot itself was never used.
+        s.sequence.store(head + m_mask + 1, lib::memory_order_release);
+        m_head.store(head + 1, lib::memory_order_relaxed);
+        return true;
+    }
+
+    /// Whether the next value in ticket order is ready to pop
+    /**
+     * May be called from any thread. The consumer uses this after releasing
+     * its claim on the queue to detect pushes that raced with the release.
+     */
+    bool pending() const {
+        slot * slots = m_slots.load(lib::memory_order_seq_cst);
+        if (!slots) {
+            return false;
+        }
+        size_t head = m_head.load(lib::memory_order_relaxed);
+        return slots[head & m_mask].sequence.load(lib::memory_order_seq_cst)
+            == head + 1 || m_overflow.pending();
+    }
+private:
+    struct slot {
+        lib::atomic<size_t> sequence;
+        T value;
+    };
+
+    typedef std::map<size_t,T> spill_map;
+
+    static size_t round_up(size_t n) {
+        size_t p = 1;
+        while (p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    /// The slot array, allocated by whichever push needs it first
+    slot * allocate() {
+        slot * slots = m_slots.load(lib::memory_order_acquire);
+        if (slots) {
+            return slots;
+        }
+        slot * fresh = new slot[m_mask + 1];
+        for (size_t i = 0; i <= m_mask; i++) {
+            fresh[i].sequence.store(i, lib::memory_order_relaxed);
+        }
+        if (m_slots.compare_exchange_strong(slots, fresh,
+            lib::memory_order_acq_rel, lib::memory_order_acquire))
+        {
+            return fresh;
+        }
+        delete[] fresh;
+        return slots;
+    }
+
+    /// Look for a spilled value with the given ticket. Consumer only.
+    bool take_spilled(size_t ticket, T & value) {
+        if (m_overflow.pending()) {
+            std::pair<size_t,T> entry;
+            while (m_overflow.pop(entry)) {
+                using std::swap;
+                swap(m_spilled[entry.first], entry.second);
+            }
+        }
+
+        typename spill_map::iterator it = m_spilled.find(ticket);
+        if (it == m_spilled.end()) {
+            return false;
+        }
+
+        using std::swap;
+        swap(value, it->second);
+        m_spilled.erase(it);
+        return true;
+    }
+
+    // Non-copyable
+    ring(ring const &);
+    ring & operator=(ring const &);
+
+    size_t const m_mask;
+    lib::atomic<slot *> m_slots;
+    lib::atomic<size_t> m_tail;
+    lib::atomic<size_t> m_head;
+
+    mpsc<std::pair<size_t,T> > m_overflow;
+
+    /// Spilled values taken off m_overflow whose ticket is not yet due
+    spill_map m_spilled;
+};
+
+} // namespace send_queue
+} // namespace websocketpp
+
+#endif // WEBSOCKETPP_SEND_QUEUE_HPP